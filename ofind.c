@@ -19,21 +19,48 @@
 **    Bump NCOMPAT, was running out for big still-life searches
 */
 
+#define _DEFAULT_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <errno.h>
+#include <signal.h>
+#include <netdb.h>
+#include <dirent.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+#include <sys/mman.h>
+#include <sys/time.h>
+#include <fcntl.h>
+#include <time.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
 
 // this was defined to abstract rng implementation in legacy platforms
 #define random() rand()
 
 void exit(int);
 static void failure();
+static void writeCheckpoint();
+static void reportStats(char * event);
+static void * growArray(void * p, long * size, long needed, size_t eltSize);
 
 /* define DEBUG */
 
+/* per-thread copies of the search scratch space; see "Worker threads" below */
+#define THREADLOCAL __thread
+int nThreads = 1;
+
 typedef enum { none, odd, even } sym_type;
 sym_type symmetry = even;
-sym_type row_symmetry;
-int row_sym_phase_offset;
+THREADLOCAL sym_type row_symmetry;
+THREADLOCAL int row_sym_phase_offset;
 int allow_row_sym = 1;
 int rule = 010014;
 int period = 5;
@@ -42,8 +69,10 @@ int leftStatorWidth = 0;
 int rightStatorWidth = 0;
 int maxDeepen = 0;
 int hashing = 1;
+int verbose = 0;
 int sparkLevel = 0;
 int zeroLotLine = 0;
+int failureStatus = 0;	/* exit status of failure(), nonzero in a work unit */
 #define totalWidth (rotorWidth+leftStatorWidth+rightStatorWidth)
 #define MAXPERIOD 20
 
@@ -74,22 +103,152 @@ static void beNice()
 #define NICE()
 #endif
 
+/* ============================ */
+/*  Counters for the hot paths  */
+/* ============================ */
+
+/*
+** Each thread counts the calls to and time spent in the main stages of
+** expanding a state, in its own Stats so that counting needs no locking.
+** The counts are summed by reportStats() while the other threads are idle.
+** Reading the clock costs more than counting, so the stages are only timed
+** while expanding one state in STATSAMPLE, and the time counted is scaled
+** up to match; terminal() is timed for a block of states at once, always.
+** Time is in cycles from the time stamp counter on x86, nanoseconds
+** elsewhere.  Build with -DNOSTATS to compile all of this away.
+*/
+
+#define STATSAMPLE 16
+
+typedef enum { STAGE_LISTROWS, STAGE_COMPAT, STAGE_PRUNE, STAGE_REACH, STAGE_GROUP,
+			   STAGE_TERMINAL, STAGE_TERMINATE, NSTAGES } Stage;
+
+typedef struct {
+	uint64_t calls[NSTAGES], ticks[NSTAGES];
+	uint64_t states;	/* states expanded by process() */
+	int timing;	/* is the current state one of those timed? */
+	uint64_t rowsListed[MAXPERIOD];	/* extension rows found, summed over states */
+	uint64_t rowCacheHits, rowCacheMisses;	/* row lists found in cachedRows()'s cache or not */
+} Stats;
+
+#ifdef NOSTATS
+#define STAT_TIMER(t)
+#define STAT_START(t)
+#define STAT_STOP(stage,t)
+#define STAT_START_ALWAYS(t)
+#define STAT_STOP_ALWAYS(stage,t,n)
+#define STAT_ADD(field,n)
+#define STAT_SAMPLE()
+#else
+#if defined(__x86_64__) || defined(__i386__)
+#define readTicks() __rdtsc()
+#else
+static inline uint64_t readTicks(void) {
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec * 1000000000ULL + t.tv_nsec;
+}
+#endif
+THREADLOCAL Stats * threadStats;
+#define STAT_TIMER(t) uint64_t t
+#define STAT_START(t) (t = threadStats->timing ? readTicks() : 0)
+#define STAT_STOP(stage,t) (threadStats->ticks[stage] += threadStats->timing ? STATSAMPLE*(readTicks() - (t)) : 0, \
+							threadStats->calls[stage]++)
+/* for stages run once for many states, timed every time */
+#define STAT_START_ALWAYS(t) (t = readTicks())
+#define STAT_STOP_ALWAYS(stage,t,n) (threadStats->ticks[stage] += readTicks() - (t), threadStats->calls[stage] += (n))
+#define STAT_ADD(field,n) (threadStats->field += (n))
+#define STAT_SAMPLE() (threadStats->timing = threadStats->states % STATSAMPLE == 0)
+
+Stats ** allStats;	/* every thread's counters */
+long nAllStats = 0, allStatsSize = 0;
+static pthread_mutex_t statsLock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+/* give the calling thread its counters */
+static void initStats(void)
+{
+#ifndef NOSTATS
+	threadStats = calloc(1, sizeof(Stats));
+	if (threadStats == 0) {
+		fprintf(stderr,"Unable to allocate memory, aborting.\n");
+		exit(1);
+	}
+	pthread_mutex_lock(&statsLock);
+	allStats = growArray(allStats, &allStatsSize, nAllStats+1, sizeof(Stats *));
+	allStats[nAllStats++] = threadStats;
+	pthread_mutex_unlock(&statsLock);
+#endif
+}
+
 /* ========================== */
 /*  Representation of states  */
 /* ========================== */
 
-#include <inttypes.h>
+/* build with -DROWBITS=64 for rows wider than 32 cells and queues beyond 2^31 words */
+#ifndef ROWBITS
+#define ROWBITS 32
+#endif
 
+#if ROWBITS == 64
+typedef int64_t State;
+typedef uint64_t Row;
+#define STATE_SPACE_SIZE (INT64_MAX/16)
+#elif ROWBITS == 32
 typedef int32_t State;
 typedef uint32_t Row;
-
 #define STATE_SPACE_SIZE (INT32_MAX)
+#else
+#error "ROWBITS must be 32 or 64"
+#endif
+#define MAXWIDTH ROWBITS
+#define ROWBYTES (ROWBITS/8)
+
+/* mask of the low n bits of a row, for any n from 0 to ROWBITS */
+static inline Row lowBits(int n)
+{
+	return n >= ROWBITS ? ~(Row) 0 : (((Row) 1) << n) - 1;
+}
+
+/*
+** statespace is reserved as address space only; pages are committed by the
+** kernel as the queue first touches them and handed back after compaction.
+** memoryBudget (bytes, 0 for the default of 2^30 words) sets the queue size
+** at which compact() is called, and twice that much address space is
+** reserved so that deepening has room above the queue.
+*/
+
+#define DEFAULT_QUEUE_SIZE (INT32_MAX/2)
 Row * statespace; /* Will be allocated later. */
 State firstUnprocessedState;
-State firstFreeState;
+THREADLOCAL State firstFreeState;	/* workers use their own copy when deepening */
+THREADLOCAL State scratchEnd;	/* end of a deepening worker's part of statespace, or 0 */
+THREADLOCAL int scratchFull;	/* set when a child would not fit before scratchEnd */
 #define firstState (0)
-#define lastState (STATE_SPACE_SIZE)
-#define queueFull (STATE_SPACE_SIZE/2)
+State lastState;
+State queueFull;
+long memoryBudget = 0;
+
+/*
+** With -z y the rows of a queued state are packed totalWidth bits apiece
+** into as few words as hold them, after the parent word, instead of taking
+** a word each.  The rotor only ever shrinks into the stator, so totalWidth
+** and hence the layout stays fixed for the whole search.  The parent stays
+** a whole word, which compact() uses to mark unused states.
+*/
+int packQueue = 0;
+int packedWidth = 0;	/* bits per packed row, 0 if rows take a word each */
+int stateSize;	/* words per state in statespace */
+
+static void setStateSize(void)
+{
+	packedWidth = 0;
+	stateSize = period + 1;
+	if (packQueue && 1 + (period * totalWidth + ROWBITS - 1) / ROWBITS < stateSize) {
+		packedWidth = totalWidth;
+		stateSize = 1 + (period * totalWidth + ROWBITS - 1) / ROWBITS;
+	}
+}
 
 static inline State parentState(State s)
 {
@@ -101,20 +260,43 @@ static inline void setParentState(State s, State parent)
 	statespace[s] = parent;
 }
 
+/* kept out of line so that unpacked rows cost only the test of packedWidth */
+static Row packedRow(State s, int phase)
+{
+	long bit = (long) phase * packedWidth;
+	const Row * w = statespace + s + 1 + bit / ROWBITS;
+	int shift = bit % ROWBITS;
+	Row r = w[0] >> shift;
+	if (shift + packedWidth > ROWBITS) r |= w[1] << (ROWBITS - shift);
+	return r & lowBits(packedWidth);
+}
+
+static void setPackedRow(State s, int phase, Row row)
+{
+	long bit = (long) phase * packedWidth;
+	Row * w = statespace + s + 1 + bit / ROWBITS;
+	int shift = bit % ROWBITS;
+	Row mask = lowBits(packedWidth);
+	w[0] = (w[0] & ~(mask << shift)) | (row << shift);
+	if (shift + packedWidth > ROWBITS)
+		w[1] = (w[1] & ~(mask >> (ROWBITS - shift))) | (row >> (ROWBITS - shift));
+}
+
 static inline Row rowOfState(State s, int phase)
 {
+	if (packedWidth) return packedRow(s, phase);
 	return statespace[s + 1 + phase];
 }
 
-
 static inline void setRowOfState(State s, int phase, Row row)
 {
-	statespace[s + 1 + phase] = row;
+	if (packedWidth) setPackedRow(s, phase, row);
+	else statespace[s + 1 + phase] = row;
 }
 
 static State nextState(State s)
 {
-	State l = s + period + 1;
+	State l = s + stateSize;
 	if (l >= lastState) {
 		printf("Queue full, aborting!\n");
 		failure();
@@ -124,13 +306,168 @@ static State nextState(State s)
 
 static State previousState(State s)
 {
-	return s - (period + 1);
+	return s - stateSize;
+}
+
+/*
+** With -s dir the queue is a shared mapping of an unlinked file in that
+** directory instead of anonymous memory, so the kernel can write it out
+** and the queue can be larger than RAM.  The search works near only four
+** places in the queue, each moving forward: the states being expanded,
+** their parents, their grandparents, and the end where the children go.
+** Every spillSegment words of progress, streamQueue() writes back what
+** lies behind each of those places and drops it from memory, along with
+** the unexpanded states short of the end, and starts reading the next
+** segment after each place.  compact() does the same from each of its
+** passes.  -M gives the memory to keep (default a quarter of the queue):
+** an eighth of it behind each place, and three eighths for read-ahead.
+** Duplicate checks still read states anywhere in the queue, but those
+** pages stay clean and the kernel can drop them whenever it likes.
+*/
+#define SPILLSTREAMS 3	/* expanded states, parents and grandparents */
+char * spillDir = 0;
+int spillFd = -1;
+long spillMemory = 0;
+State spillSegment;	/* words streamed at a time, a sixteenth of spillMemory */
+State spillNext;	/* position at which to stream again */
+State spilledBelow;	/* compact() has written out everything below this */
+State spilledBehind[SPILLSTREAMS];	/* each stream has been written out up to here */
+State spilledAhead;	/* end of the unexpanded part written out */
+State spilledAbove;	/* everything above this has been written out */
+
+/* write back the whole pages in [from, to) and drop them from memory */
+static void spillRange(State from, State to)
+{
+	long page = sysconf(_SC_PAGESIZE);
+	char * start = (char *) (statespace + from);
+	char * end = (char *) (statespace + to);
+	start += (page - ((unsigned long) start % page)) % page;
+	end -= (unsigned long) end % page;
+	if (from >= to || start >= end) return;
+	msync(start, end - start, MS_SYNC);
+	madvise(start, end - start, MADV_DONTNEED);
+	posix_fadvise(spillFd, start - (char *) statespace, end - start, POSIX_FADV_DONTNEED);
+}
+
+/* start reading [from, to) back in without waiting for it */
+static void prefetchRange(State from, State to)
+{
+	long page = sysconf(_SC_PAGESIZE);
+	char * start = (char *) (statespace + (from < 0 ? 0 : from));
+	char * end = (char *) (statespace + (to > lastState ? lastState : to));
+	start -= (unsigned long) start % page;
+	if (start < end) madvise(start, end - start, MADV_WILLNEED);
+}
+
+static void resetSpill(State next)
+{
+	int i;
+	for (i = 0; i < SPILLSTREAMS; i++) spilledBehind[i] = 0;
+	spilledBelow = spilledAhead = 0;
+	spilledAbove = firstFreeState;
+	spillNext = next;
+}
+
+/* called from the breadth first search once firstUnprocessedState passes spillNext */
+static void streamQueue(void)
+{
+	State window = spillMemory / sizeof *statespace / 8;
+	State at = firstUnprocessedState;
+	State ahead = firstUnprocessedState + window;
+	State end = firstFreeState - window;
+	int i;
+	for (i = 0; i < SPILLSTREAMS; i++) {
+		State behind = at - window;
+		if (behind > spilledBehind[i]) {
+			spillRange(spilledBehind[i], behind);
+			spilledBehind[i] = behind;
+		}
+		prefetchRange(at, at + 2*spillSegment);
+		at = parentState(at);
+	}
+	if (ahead < spilledAhead) ahead = spilledAhead;
+	if (end > ahead) {
+		spillRange(ahead, end);
+		spilledAhead = end;
+	}
+	spillNext = firstUnprocessedState + spillSegment;
+}
+
+/* a forward pass of compact() has written up to done and reads next onwards */
+static void streamPass(State done, State next)
+{
+	State behind = done - spillMemory / sizeof *statespace / 8;
+	if (behind > spilledBelow) {
+		spillRange(spilledBelow, behind);
+		spilledBelow = behind;
+	}
+	prefetchRange(next, next + 2*spillSegment);
+	spillNext = next + spillSegment;
+}
+
+/* the backward pass of compact() is at parent x and child y */
+static void streamBack(State x, State y)
+{
+	State above = y + spillMemory / sizeof *statespace / 8;
+	if (above < spilledAbove) {
+		spillRange(above, spilledAbove);
+		spilledAbove = above;
+	}
+	prefetchRange(x - 2*spillSegment, x);
+	prefetchRange(y - 2*spillSegment, y);
+	spillNext = y - spillSegment;
+}
+
+static void openSpillFile(size_t bytes)
+{
+	char name[1100];
+	snprintf(name, sizeof name, "%s/ofind-queue-XXXXXX", spillDir);
+	spillFd = mkstemp(name);
+	if (spillFd < 0 || unlink(name) != 0 || ftruncate(spillFd, bytes) != 0) {
+		fprintf(stderr,"Unable to make a queue file in %s, aborting.\n", spillDir);
+		exit(1);
+	}
+	if (spillMemory <= 0) spillMemory = bytes / 8;
+	spillSegment = spillMemory / sizeof *statespace / 16;
+	if (spillSegment < (1<<16)) spillSegment = 1<<16;
+}
+
+static void reserveStateSpace(void)
+{
+	long words = memoryBudget / sizeof *statespace;	/* long, so a large -m is clamped, not truncated */
+	if (memoryBudget <= 0) words = DEFAULT_QUEUE_SIZE;
+	if (words > STATE_SPACE_SIZE/2) words = STATE_SPACE_SIZE/2;
+	queueFull = words;
+	lastState = 2*words;
+	if (spillDir) {
+		openSpillFile(lastState * sizeof *statespace);
+		statespace = mmap(0, lastState * sizeof *statespace, PROT_READ | PROT_WRITE,
+						  MAP_SHARED, spillFd, 0);
+		resetSpill(0);
+	} else statespace = mmap(0, lastState * sizeof *statespace, PROT_READ | PROT_WRITE,
+							 MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (statespace == MAP_FAILED) {
+		fprintf(stderr,"Unable to reserve %ld bytes for the queue, aborting.\n",
+				(long) (lastState * sizeof *statespace));
+		exit(1);
+	}
+}
+
+/* give back the pages above the end of the queue */
+static void releaseStateSpace(void)
+{
+	long page = sysconf(_SC_PAGESIZE);
+	char * start = (char *) (statespace + firstFreeState);
+	char * end = (char *) (statespace + lastState);
+	start += (page - ((unsigned long) start % page)) % page;
+	if (start < end) madvise(start, end - start, MADV_DONTNEED);
 }
 
 static void makeInitialStates(void)
 {
 	int phase;
-	statespace = calloc(STATE_SPACE_SIZE, sizeof *statespace);
+	reserveStateSpace();
+	setStateSize();
 	firstUnprocessedState = firstState;
 	setParentState(firstUnprocessedState, firstUnprocessedState);
 	for (phase = 0; phase < period; phase++)
@@ -142,27 +479,156 @@ static void makeInitialStates(void)
 /*  Hash table for duplicate state elimination  */
 /* ============================================ */
 
-#define HASHSIZE (1<<21)
-#define HASHMASK (HASHSIZE - 1)
-State hashTable[HASHSIZE];
+/*
+** Open addressing with linear probing.  Each slot keeps the high half of
+** the state's hash key as a check, so isDuplicate() only touches statespace
+** when the checks agree.  The table starts at MINHASHSIZE slots and doubles
+** whenever it becomes half full, up to twice the number of states the
+** queue can hold; only past that limit do full probe runs leave states
+** unhashed.  That limit is not charged against -m: two slots per state
+** come to 4/stateSize times -m, so at most twice -m.
+*/
+
+#define MINHASHSIZE (1<<21)
+#define HASHPROBES 32
+typedef struct {
+	State state;	/* 0 for an empty slot */
+	uint32_t check;
+} HashEntry;
+HashEntry * hashTable;
+long hashSize = 0, hashCount = 0;
+long hashHits = 0, hashMisses = 0, hashGiveUps = 0, hashClashes = 0;
+
+/*
+** The key mixes whole rows of the state and of its parent, the two things
+** isDuplicate() compares, with a multiply-xorshift step per 64-bit word and
+** a final avalanche, so every bit of the key depends on every row.  It reads
+** nothing but statespace, so any thread may compute it.
+*/
+#define HASHMULT 0x9e3779b97f4a7c15ULL
+
+static inline uint64_t mix64(uint64_t x) {
+	x ^= x >> 32;
+	x *= 0xd6e8feb86659fd93ULL;
+	x ^= x >> 32;
+	x *= 0xd6e8feb86659fd93ULL;
+	x ^= x >> 32;
+	return x;
+}
+
+static uint64_t hashKey(State s) {
+	State p = parentState(s);
+	uint64_t key = period;
+	int phase;
+	for (phase = 0; phase < period; phase++) {
+#if ROWBITS == 64
+		key = (key ^ rowOfState(s, phase)) * HASHMULT;
+		key ^= key >> 29;
+		key = (key ^ rowOfState(p, phase)) * HASHMULT;
+		key ^= key >> 29;
+#else
+		key = (key ^ ((uint64_t) rowOfState(s, phase) << 32 | rowOfState(p, phase))) * HASHMULT;
+		key ^= key >> 29;
+#endif
+	}
+	return mix64(key);
+}
 
-long hashValTab[MAXPERIOD*1024];
-long hashValPTab[MAXPERIOD*1024];
-#define HASHIDX(p,b,s) ((p)<<10)+(b<<8)+((rowOfState(s, p)>>(b*8))&0xff)
+/*
+** The key used before, a sum of random() values per row byte, kept only so
+** hashBenchmark() can compare the two on real queues.
+*/
+#define HASHTABSIZE (MAXPERIOD*ROWBYTES*256)
+long * hashValTab;
+long * hashValPTab;
+#define HASHIDX(p,b,s) ((((p)*ROWBYTES+(b))<<8)+((rowOfState(s, p)>>((b)*8))&0xff))
 #define HASHBYTE(phase,byte,s) (hashValTab[HASHIDX(phase,byte,s)]+hashValPTab[HASHIDX(phase,byte,parentState(s))])
 
+static uint64_t byteTableKey(State s) {
+	uint64_t key = 0;
+	int phase, byte;
+	for (phase = 0; phase < period; phase++)
+		for (byte = 0; byte < ROWBYTES; byte++)
+			key += HASHBYTE(phase,byte,s);
+	return key;
+}
+
+static HashEntry * allocHash(long size) {
+	HashEntry * t = calloc(size, sizeof(HashEntry));
+	if (t == 0) {
+		fprintf(stderr,"Unable to allocate hash table, aborting.\n");
+		exit(1);
+	}
+	return t;
+}
+
 static void clearHash() {
-	int i;
-	for (i = 0; i < HASHSIZE; i++) hashTable[i] = 0;
+	memset(hashTable, 0, hashSize * sizeof(HashEntry));
+	hashCount = 0;
 }
 
 static void initHash() {
+	hashSize = MINHASHSIZE;
+	hashTable = allocHash(hashSize);
+}
+
+/* double the table unless it already covers the whole queue */
+static void growHash() {
+	HashEntry * old = hashTable;
+	long oldSize = hashSize;
+	long i, j;
+	if (hashSize >= 2 * (queueFull / stateSize)) return;
+	hashSize *= 2;
+	hashTable = allocHash(hashSize);
+	for (i = 0; i < oldSize; i++) if (old[i].state != 0) {
+		j = hashKey(old[i].state) & (hashSize - 1);
+		while (hashTable[j].state != 0) j = (j + 1) & (hashSize - 1);
+		hashTable[j] = old[i];
+	}
+	free(old);
+}
+
+static void printHashStats() {
+	printf("Hash table: %ld of %ld slots used, %ld duplicates, %ld new, %ld unhashed, %ld check clashes\n",
+		   hashCount, hashSize, hashHits, hashMisses, hashGiveUps, hashClashes);
+}
+
+/*
+** With -v, compare the keys on the queue as it stands after a compaction:
+** for a table of twice as many slots as states, count the states whose
+** slot is already taken by an earlier one.  A random function gives at most
+** about 21% at that load; clustering shows up as a higher count.
+*/
+static long slotCollisions(uint64_t (*key)(State), long size) {
+	unsigned char * used = calloc(size / 8, 1);
+	long n = 0;
+	State s;
+	if (used == 0) return -1;
+	for (s = nextState(firstState); s < firstFreeState; s = nextState(s)) {
+		long i = key(s) & (size - 1);
+		if (used[i>>3] & (1 << (i&7))) n++;
+		else used[i>>3] |= 1 << (i&7);
+	}
+	free(used);
+	return n;
+}
+
+static void hashBenchmark() {
+	long states = (firstFreeState - nextState(firstState)) / stateSize;
+	long size = 64;
 	int i;
-	clearHash();
-	for (i = 0; i < MAXPERIOD*1024; i++) {
-		hashValTab[i] = random();
-		hashValPTab[i] = random();
+	if (hashValTab == 0) {
+		hashValTab = malloc(HASHTABSIZE * sizeof(long));
+		hashValPTab = malloc(HASHTABSIZE * sizeof(long));
+		if (hashValTab == 0 || hashValPTab == 0) return;
+		for (i = 0; i < HASHTABSIZE; i++) {
+			hashValTab[i] = random();
+			hashValPTab[i] = random();
+		}
 	}
+	while (size < 2 * states) size *= 2;
+	printf("Slot collisions among %ld states in %ld slots: %ld mixed key, %ld byte table key\n",
+		   states, size, slotCollisions(hashKey, size), slotCollisions(byteTableKey, size));
 }
 
 static int isDuplicate(State s, State t) {
@@ -178,23 +644,32 @@ static int isDuplicate(State s, State t) {
 /* hash a value, return nonzero if not hashed because duplicate exists */
 static int hash(State s)
 {
-	long hashKey = 0;
-	int nTries = 3;
-	int phase;
+	uint64_t key = hashKey(s);
+	uint32_t check = key >> 32;
+	long i;
+	int nTries = HASHPROBES;
 
-	/* compute hash key */
-	for (phase = 0; phase < period; phase++)
-		hashKey += HASHBYTE(phase,0,s) + HASHBYTE(phase,1,s) +
-					  HASHBYTE(phase,2,s) + HASHBYTE(phase,3,s);
+	if (2 * hashCount >= hashSize) growHash();
 
 	/* attempt to locate blank spot or duplicate */
-	while (nTries-- > 0) {
-		if (hashTable[hashKey & HASHMASK] == 0) {
-			hashTable[hashKey & HASHMASK] = s;
+	for (i = key & (hashSize - 1); nTries-- > 0; i = (i + 1) & (hashSize - 1)) {
+		HashEntry * e = &hashTable[i];
+		if (e->state == 0) {
+			e->state = s;
+			e->check = check;
+			hashCount++;
+			hashMisses++;
 			return 0;	/* successfully hashed */
-		} else if (isDuplicate(s, hashTable[hashKey & HASHMASK])) return 1;
-		hashKey += (hashKey >> 16);
+		}
+		if (e->check == check) {
+			if (isDuplicate(s, e->state)) {
+				hashHits++;
+				return 1;
+			}
+			hashClashes++;
+		}
 	}
+	hashGiveUps++;
 	return 0;	/* unable to find blank, ignore but dont treat as a duplicate */
 }
 
@@ -216,7 +691,7 @@ static int hash(State s)
 ** The first cell in extensions[i] corresponds to row&(1<<i).
 */
 
-int extensions[32];
+THREADLOCAL int extensions[MAXWIDTH];
 int downShifts[256];
 static void makeDownShifts(void) {
 	int x;
@@ -295,71 +770,294 @@ static void setupExtensions(Row a, Row b, Row c, Row sparkMask)
 /*  Make list of possible extension rows given info from setupExtensions  */
 /* ====================================================================== */
 
-#define NROWS (1<<20) /* 4 megabytes */
-Row rows[NROWS];
-int firstRow[MAXPERIOD];
-int nRows[MAXPERIOD];
+THREADLOCAL Row * rows;	/* grows as needed, see listRows() */
+THREADLOCAL long rowsSize;
+THREADLOCAL int firstRow[MAXPERIOD];
+THREADLOCAL int nRows[MAXPERIOD];
 
-static void listRows(Row partialRow, int phase, int bit, int extension)
+/*
+** Walk the binary tree of rows from the high bit down, as the recursive
+** version did, keeping the masked extension set of each level in m[]
+** and the path in row itself: a zero bit above the current level is a
+** branch whose one side is still to be tried.  Rows come out in
+** increasing order, and are appended to rows[] after the rows of earlier
+** phases; returns the number found.
+*/
+static int listRows(int phase)
 {
-	if (extension != 0) {
-		if (bit < 0) {	/* found a full matching row */
-			rows[firstRow[phase] + (nRows[phase]++)] = partialRow;
-			if (firstRow[phase] + nRows[phase] >= NROWS) {
-				printf("max number of new rows/state exceeded, aborting\n");
-				failure();
-			}
+	int m[MAXWIDTH];
+	int level = totalWidth-1;
+	int extension = 03;
+	int n = 0;
+	Row row = 0;
+	for (;;) {
+		/* follow zero branches as far as they go */
+		while (level >= 0 && (m[level] = extension & extensions[level]) != 0) {
+			extension = downShift(m[level] & 0125);
+			level--;
+		}
+		if (level < 0 && extension != 0) {	/* found a full matching row */
+			if (firstRow[phase]+n >= rowsSize)
+				rows = growArray(rows, &rowsSize, firstRow[phase]+n+1, sizeof(Row));
+			rows[firstRow[phase]+n] = row;
+			n++;
 			NICE();
-		} else {
-			extension &= extensions[bit];
-			listRows(partialRow, phase, bit-1, downShift(extension & 0125));
-			listRows(partialRow+(1<<bit), phase, bit-1, downShift(extension & 0252));
 		}
+
+		/* back up to the lowest zero branch and take its one side */
+		for (level++; level < totalWidth && (row & (((Row) 1)<<level)); level++)
+			row &= ~(((Row) 1)<<level);
+		if (level >= totalWidth) break;
+		row |= ((Row) 1)<<level;
+		extension = downShift(m[level] & 0252);
+		level--;
+	}
+	return n;
+}
+
+/* ========================================== */
+/*  Cache of row lists for repeated neighbours  */
+/* ========================================== */
+
+/*
+** The rows listed for a phase depend only on the state's row, its parent's
+** row and the state's row in the next phase, with the spark mask, and
+** siblings and cousins often share these, especially in the stator columns.
+** Each thread keeps a cache of recent lists, set-associative with room for
+** ROWCACHEWAYS lists per set, replacing the least recently used list of a
+** set first.  Lists of more than ROWCACHEROWS rows are not cached.  -L sets
+** the number of lists cached per thread, 0 to turn the cache off.
+*/
+#define ROWCACHEWAYS 4
+#define ROWCACHEROWS 16
+
+typedef struct {
+	Row a, b, c, sparkMask;
+	uint64_t used;	/* rowCacheClock at last use, 0 if empty */
+	int n;
+	Row rows[ROWCACHEROWS];
+} RowCacheEntry;
+
+long rowCacheEntries = 4096;
+THREADLOCAL RowCacheEntry * rowCache;	/* null when off */
+THREADLOCAL long rowCacheSets;	/* a power of two */
+THREADLOCAL uint64_t rowCacheClock;
+
+static void initRowCache(void)
+{
+	rowCache = 0;
+	if (rowCacheEntries <= 0) return;
+	for (rowCacheSets = 1; rowCacheSets * ROWCACHEWAYS < rowCacheEntries; rowCacheSets <<= 1) ;
+	rowCache = calloc(rowCacheSets * ROWCACHEWAYS, sizeof(RowCacheEntry));
+	if (rowCache == 0) {
+		fprintf(stderr,"Unable to allocate memory, aborting.\n");
+		exit(1);
+	}
+}
+
+/* same as setupExtensions(a,b,c,sparkMask) then listRows(phase), but cached */
+static int cachedRows(int phase, Row a, Row b, Row c, Row sparkMask)
+{
+	RowCacheEntry * set, * victim;
+	uint64_t h;
+	int i, n;
+	if (rowCache == 0) {
+		setupExtensions(a, b, c, sparkMask);
+		return listRows(phase);
+	}
+	h = (uint64_t) a * 0x9e3779b97f4a7c15ULL ^ (uint64_t) b * 0xc2b2ae3d27d4eb4fULL ^
+		(uint64_t) c * 0x165667b19e3779f9ULL ^ (uint64_t) sparkMask;
+	h ^= h >> 31;
+	set = rowCache + (h & (rowCacheSets - 1)) * ROWCACHEWAYS;
+	victim = set;
+	rowCacheClock++;
+	for (i = 0; i < ROWCACHEWAYS; i++) {
+		RowCacheEntry * e = set + i;
+		if (e->used && e->a == a && e->b == b && e->c == c && e->sparkMask == sparkMask) {
+			e->used = rowCacheClock;
+			if (firstRow[phase]+e->n > rowsSize)
+				rows = growArray(rows, &rowsSize, firstRow[phase]+e->n, sizeof(Row));
+			for (n = 0; n < e->n; n++) rows[firstRow[phase]+n] = e->rows[n];
+			STAT_ADD(rowCacheHits, 1);
+			return e->n;
+		}
+		if (e->used < victim->used) victim = e;
 	}
+	setupExtensions(a, b, c, sparkMask);
+	n = listRows(phase);
+	STAT_ADD(rowCacheMisses, 1);
+	if (n <= ROWCACHEROWS) {
+		victim->a = a;
+		victim->b = b;
+		victim->c = c;
+		victim->sparkMask = sparkMask;
+		victim->used = rowCacheClock;
+		victim->n = n;
+		memcpy(victim->rows, rows+firstRow[phase], n * sizeof(Row));
+	}
+	return n;
 }
 
-int rowIndices[MAXPERIOD];
-#define STATMASK ((((1<<rightStatorWidth)-1)<<(rotorWidth+leftStatorWidth))|((1<<leftStatorWidth)-1))
+THREADLOCAL int rowIndices[MAXPERIOD];
+#define STATMASK ((lowBits(totalWidth) & ~lowBits(rotorWidth+leftStatorWidth)) | lowBits(leftStatorWidth))
 
 /* =============================================== */
 /*  Test and store compatibility of pairs of rows  */
 /* =============================================== */
 
-#define NCOMPAT (1<<21)
-Row compatBits[NCOMPAT];
-int firstCompat[MAXPERIOD];
-int compatBlockLength[MAXPERIOD];
+/* compatBits and reachBits are per-thread arenas, doubled whenever a stator group needs more */
+THREADLOCAL Row * compatBits;
+THREADLOCAL long compatSize;
+THREADLOCAL long firstCompat[MAXPERIOD];
+THREADLOCAL int compatBlockLength[MAXPERIOD];
+
+/*
+** Compatibility is tested for one row against every row of the previous
+** phase at once, COMPATLANES rows at a time.  Each lane runs the same
+** automaton as setupExtensions(), with b and c fixed, so the extTab lookups
+** of a column are independent of each other and can be done by vector
+** gathers; the lanes' results are then exactly one word of compatBits.
+** On x86 the column loop is compiled for AVX-512 and AVX2 as well as the
+** baseline, and the best version is chosen when the program starts.
+*/
+
+#define COMPATLANES 32
+#if defined(__GNUC__) && defined(__x86_64__) && !defined(__clang__)
+#define SIMD_CLONES __attribute__((target_clones("avx512f","avx2","default")))
+#else
+#define SIMD_CLONES
+#endif
+
+/* first state of setupExtensions() automaton, before column 0 */
+static inline int startExtension(Row a, Row b, Row c)
+{
+	switch (symmetry) {
+		case none:
+			return nextExtension(nextExtension(1,a<<2,b<<2,c<<2),a<<1,b<<1,c<<1);
+		case odd:
+			return nextExtension(0377,(a<<1) | ((a&2)>>1), (b<<1) | ((b&2)>>1), c<<1) & 0245;
+		case even:
+			return nextExtension(0303, (a<<1) | (a&1), (b<<1) | (b&1), c<<1);
+		default:
+			__builtin_unreachable();
+	}
+}
+
+/* set bits of word for the prev[] rows that can precede row c, given b */
+SIMD_CLONES
+static Row compatWord(const Row * prev, int n, Row b, Row c)
+{
+	int x[COMPATLANES];
+	Row a[COMPATLANES];
+	Row word = 0;
+	int i, l;
+	if (n > COMPATLANES) n = COMPATLANES;
+	for (l = 0; l < n; l++) {
+		a[l] = prev[l];
+		x[l] = (a[l] & STATMASK) == (c & STATMASK) ? startExtension(a[l], b, c) : 0;
+	}
+	for (i = 0; i < totalWidth; i++) {
+		int k = EXTIDX(0, 0, b>>i, c>>i);
+		int any = 0;
+		for (l = 0; l < n; l++) {
+			x[l] = extTab[(x[l]<<7) | ((int)(a[l]>>i) & 7)<<4 | k];
+			any |= x[l];
+		}
+		if (!any) return 0;
+	}
+	for (l = 0; l < n; l++)
+		if (03 & x[l]) word |= ((Row) 1) << l;
+	return word;
+}
 
-static void testCompatible(int phase, int prevRowIndex, int rowIndex, State s)
+/* returns nonzero if some row of the previous phase can precede this one */
+static Row testCompatible(int phase, int rowIndex, State s)
 {
 	Row * b;
+	Row any = 0;
+	int i;
 	int prevPhase = phase - 1;
 	if (prevPhase < 0) prevPhase = period - 1;
 	if (rowIndex == firstRow[phase]) {
 		if (phase == 0) firstCompat[0] = 0;
 		else firstCompat[phase] = firstCompat[prevPhase] +
-							(compatBlockLength[prevPhase]*nRows[prevPhase]);
+							((long) compatBlockLength[prevPhase]*nRows[prevPhase]);
 		compatBlockLength[phase] = (nRows[prevPhase]+31)>>5;
-		if (firstCompat[phase]+(compatBlockLength[phase]*nRows[phase]) > NCOMPAT) {
-			fprintf(stderr,"Compatibility block space exceeded, aborting.\n");
-			failure();
-		}
-	}
-	b = compatBits + firstCompat[phase] + (compatBlockLength[phase]*(rowIndex-firstRow[phase]));
-	if (prevRowIndex == firstRow[prevPhase]) {	/* clear bits if first test for rowIndex */
-		int i;
-		for (i = 0; i < compatBlockLength[phase]; i++) b[i] = 0;
+		compatBits = growArray(compatBits, &compatSize,
+							   firstCompat[phase] + (long) compatBlockLength[phase]*nRows[phase], sizeof(Row));
 	}
+	b = compatBits + firstCompat[phase] + ((long) compatBlockLength[phase]*(rowIndex-firstRow[phase]));
+	for (i = 0; i < compatBlockLength[phase]; i++)
+		any |= b[i] = compatWord(rows + firstRow[prevPhase] + COMPATLANES*i, nRows[prevPhase] - COMPATLANES*i,
+								 rowOfState(s, prevPhase), rows[rowIndex]);
+	return any;
+}
 
-	/* do stators match? */
-	if ((rows[prevRowIndex] & STATMASK) != (rows[rowIndex] & STATMASK)) return;
+/*
+** Before enumerating, remove rows that cannot be in any cycle of compatible
+** rows: a row is dropped as soon as no remaining row of the previous phase
+** can precede it (its compatibility block is empty) or no remaining row of
+** the next phase can follow it (no block of the next phase has its bit).
+** Dropping a row empties its block and clears its bit from the blocks of
+** the next phase, which may drop more rows in turn, until nothing changes.
+** Rows are only removed, never reordered, so the children found are the
+** same and in the same order; but testReachable() and processGroup() skip
+** over the dead rows, and a group with a phase left empty is abandoned.
+*/
+THREADLOCAL Row * liveMask;
+THREADLOCAL long liveMaskSize;
+
+static int blockEmpty(Row * b, int n)
+{
+	int i;
+	for (i = 0; i < n; i++) if (b[i]) return 0;
+	return 1;
+}
 
-	/* passed stator check, now check for ok evolution */
-	setupExtensions(rows[prevRowIndex],rowOfState(s, prevPhase),rows[rowIndex],-1L);
-	if (03 & extensions[totalWidth - 1]) {	/* path exists? */
-		int i = prevRowIndex - firstRow[prevPhase];
-		b[i>>5] |= ((Row) 1) << (i&037);
+/* returns 0 if some phase has no rows left */
+static int pruneRows(void)
+{
+	int changed = 1;
+	while (changed) {
+		int phase;
+		changed = 0;
+		for (phase = 0; phase < period; phase++) {
+			int next = phase == period-1 ? 0 : phase+1;
+			int len = compatBlockLength[phase], nextLen = compatBlockLength[next];
+			Row * blocks = compatBits + firstCompat[phase];
+			Row * nextBlocks = compatBits + firstCompat[next];
+			int i, w, live = 0;
+
+			/* rows of this phase that some row of the next phase can follow */
+			liveMask = growArray(liveMask, &liveMaskSize, nextLen, sizeof(Row));
+			for (w = 0; w < nextLen; w++) liveMask[w] = 0;
+			for (i = 0; i < nRows[next]; i++)
+				for (w = 0; w < nextLen; w++) liveMask[w] |= nextBlocks[(long) i*nextLen + w];
+
+			/* drop the rest, and those no row of the previous phase can precede */
+			for (i = 0; i < nRows[phase]; i++) {
+				Row * b = blocks + (long) i*len;
+				if (blockEmpty(b, len)) {
+					liveMask[i>>5] &= ~(((Row) 1) << (i & 037));
+					continue;
+				}
+				if (!(liveMask[i>>5] & (((Row) 1) << (i & 037)))) {
+					for (w = 0; w < len; w++) b[w] = 0;
+					changed = 1;
+				} else live++;
+			}
+			if (live == 0) return 0;
+
+			/* rows of the next phase can only follow rows still here */
+			for (i = 0; i < nRows[next]; i++) {
+				Row * b = nextBlocks + (long) i*nextLen;
+				int wasLive = !blockEmpty(b, nextLen);
+				for (w = 0; w < nextLen; w++) b[w] &= liveMask[w];
+				if (wasLive && blockEmpty(b, nextLen)) changed = 1;
+			}
+		}
 	}
+	return 1;
 }
 
 static int compatible(int phase, int prevRowIndex, int rowIndex)
@@ -368,7 +1066,7 @@ static int compatible(int phase, int prevRowIndex, int rowIndex)
 	Row * b;
 	int prevPhase = phase - 1;
 	if (prevPhase < 0) prevPhase = period - 1;
-	b = compatBits + firstCompat[phase] + (compatBlockLength[phase]*(rowIndex-firstRow[phase]));
+	b = compatBits + firstCompat[phase] + ((long) compatBlockLength[phase]*(rowIndex-firstRow[phase]));
 	i = prevRowIndex - firstRow[prevPhase];
 	return b[i>>5] & (((Row) 1) << (i & 037));
 }
@@ -377,46 +1075,65 @@ static int compatible(int phase, int prevRowIndex, int rowIndex)
 /*  Test and store information about which rows in phase 0 can be reached  */
 /* ======================================================================= */
 
-#define REACHLENGTH ((nRows[0]+31)>>5)
-Row reachBits[NCOMPAT];
-int firstReach[MAXPERIOD];
+#define REACHLENGTH ((nRows[0]+63)>>6)
+THREADLOCAL uint64_t * reachBits;
+THREADLOCAL long reachSize;
+THREADLOCAL long firstReach[MAXPERIOD];
+
+static int reachable(int phase, int firstRowIndex, int rowIndex) {
+	return (reachBits[firstReach[phase] + ((long) rowIndex*REACHLENGTH) + (firstRowIndex>>6)]
+		>> (firstRowIndex & 077)) & 1;
+}
 
-static long reachable(int phase, int firstRowIndex, int rowIndex) {
-	return reachBits[firstReach[phase] + (rowIndex*REACHLENGTH) + (firstRowIndex>>5)]
-		& (((Row) 1) << (firstRowIndex & 037));
+/*
+** A row's compatibility block lists the rows of the previous phase that can
+** come before it, so each set bit (found with ctz, skipping empty words)
+** adds this row's whole 64-bit-word reach set to that previous row's set.
+** The cost is one pass of REACHLENGTH words per compatible pair, and rows
+** that reach nothing are skipped outright.  With from == 0 (phase 0),
+** each row instead adds just itself.
+*/
+static void reachBlock(int phase, long prevBase, uint64_t * from)
+{
+	int i, k, w;
+	for (i = 0; i < nRows[phase]; i++) {
+		Row * b = compatBits + firstCompat[phase] + (long) compatBlockLength[phase]*i;
+		uint64_t * src = from + (long) i*REACHLENGTH;
+		if (from) {
+			for (k = 0; k < REACHLENGTH && src[k] == 0; k++) ;
+			if (k == REACHLENGTH) continue;	/* nothing reachable through this row */
+		}
+		for (w = 0; w < compatBlockLength[phase]; w++) {
+			uint32_t word = b[w];
+			while (word) {
+				uint64_t * dst = reachBits + prevBase +
+								 (long) (w*32 + __builtin_ctz(word))*REACHLENGTH;
+				word &= word - 1;
+				if (!from) dst[i>>6] |= ((uint64_t) 1) << (i & 077);
+				else for (k = 0; k < REACHLENGTH; k++) dst[k] |= src[k];
+			}
+		}
+	}
 }
 
 static void testReachable()
 {
 	int phase;
-	int i, j, k;
+	long i;
 
-	/* start w/last phase */
+	/* start w/last phase, which reaches the phase 0 rows it is compatible with */
 	firstReach[period-1] = 0;
-	for (i = 0; i < nRows[period-1]; i++) {
-		for (j = 0; j < REACHLENGTH; j++) reachBits[i*REACHLENGTH + j] = 0;
-		for (j = 0; j < nRows[0]; j++)
-			if (compatible(0, firstRow[period-1]+i, firstRow[0]+j)) {
-				reachBits[i*REACHLENGTH + (j>>5)] |= (((Row)1) << (j & 037));
-			}
-	}
+	reachBits = growArray(reachBits, &reachSize, (long) nRows[period-1]*REACHLENGTH, sizeof(uint64_t));
+	for (i = 0; i < (long) nRows[period-1]*REACHLENGTH; i++) reachBits[i] = 0;
+	reachBlock(0, 0, 0);
 
 	/* now do all remaining phases */
 	for (phase = period-2; phase >= 0; phase--) {
-		firstReach[phase] = firstReach[phase+1] + nRows[phase+1]*REACHLENGTH;
-		if (firstReach[phase] + nRows[phase]*REACHLENGTH >= NCOMPAT) {
-			printf("Reachability block storage exceeded, aborting\n");
-			failure();
-		}
-		for (i = 0; i < nRows[phase]; i++) {
-			int idx = firstReach[phase] + i*REACHLENGTH;
-			for (j = 0; j < REACHLENGTH; j++) reachBits[idx+j] = 0;
-			for (j = 0; j < nRows[phase+1]; j++)
-				if (compatible(phase+1, firstRow[phase]+i, firstRow[phase+1]+j)) {
-					for (k = 0; k < REACHLENGTH; k++)
-						reachBits[idx+k] |= reachBits[firstReach[phase+1] + j*REACHLENGTH + k];
-				}
-		}
+		firstReach[phase] = firstReach[phase+1] + (long) nRows[phase+1]*REACHLENGTH;
+		reachBits = growArray(reachBits, &reachSize, firstReach[phase] + (long) nRows[phase]*REACHLENGTH,
+							  sizeof(uint64_t));
+		for (i = 0; i < (long) nRows[phase]*REACHLENGTH; i++) reachBits[firstReach[phase]+i] = 0;
+		reachBlock(phase+1, firstReach[phase], reachBits + firstReach[phase+1]);
 	}
 }
 
@@ -431,22 +1148,26 @@ static void testReachable()
 unsigned short revTerm[1<<16];
 Row count[8];
 unsigned short nxTerm[1<<22];
+unsigned short nxTermLow[1<<14], nxTermHigh[1<<14];	/* nxTerm split by halves of the term state */
+int splitTerm = 0;	/* -H: use nxTermLow and nxTermHigh instead of nxTerm */
 unsigned short initialTermState;
 int addlStatorCols;
 
 /* output single cell of a found pattern */
+FILE * patternOut;	/* where found patterns are written, normally stdout */
+
 static void putCell(Row row, int bit) {
-	putchar(row & (1L<<bit)? 'o' : '.');
+	putc(bit < ROWBITS && ((row >> bit) & 1) ? 'o' : '.', patternOut);
 }
 
 /* output single row of a found pattern */
 static void putRow(Row theRow)
 {
 	int bit;
-	for (bit = 0; bit < addlStatorCols; bit++) putchar('.');
+	for (bit = 0; bit < addlStatorCols; bit++) putc('.', patternOut);
 	switch(symmetry) {
 		case none:
-			if (addlStatorCols == 0) putchar('.'); /* hack to fix bad output alignment */
+			if (addlStatorCols == 0) putc('.', patternOut); /* hack to fix bad output alignment */
 			break;
 		case odd:
 			for (bit = totalWidth-1; bit > 0; bit--) putCell(theRow,bit);
@@ -456,7 +1177,7 @@ static void putRow(Row theRow)
 			break;
 	}
 	for (bit = 0; bit <= totalWidth+addlStatorCols-1; bit++) putCell(theRow,bit);
-	putchar('\n');
+	putc('\n', patternOut);
 }
 
 /* format of termState (unsigned short):
@@ -470,8 +1191,22 @@ static void putRow(Row theRow)
  * so to reverse a state, we just need to swap b1<->b2 and b3<->b4
  */
 
-#define NEXTTERM(t,r,pr,sr,i) NXTERM(t,((r)>>i)&7,count[((pr)>>i)&7],((sr)>>(i+1))&1)
-#define NXTERM(t,r,pr,sr) nxTerm[(t) | ((r)<<19) | (pr) | ((sr) << 16)]
+#define NEXTTERM(split,t,r,pr,sr,i) NXTERM(split,t,((r)>>(i))&7,count[((pr)>>(i))&7],((sr)>>(i)>>1)&1)
+/*
+** A successor of a term state is the union of the successors of its blocks,
+** so nxTerm[t | x] is nxTermLow[x>>8 | t&0377] | nxTermHigh[x>>8 | t>>8]
+** for the six bits x of row, count and successor bit.  The two halves take
+** 64K between them instead of nxTerm's 8M, and fit in the cache, but cost
+** two lookups instead of one.  Searches only reach a few term states, so
+** the parts of nxTerm they use mostly stay in the cache anyway, and the
+** single lookup is usually as fast or faster.  The functions that look
+** them up take split as a constant parameter of an inline body, and test
+** splitTerm once per call to pick the version, not once per lookup.
+*/
+#define NXTERMX(r,pr,sr) (((r)<<19) | (pr) | ((sr) << 16))
+#define NXTERM(split,t,r,pr,sr) ((split) ? \
+	nxTermLow[(NXTERMX(r,pr,sr) >> 8) | ((t) & 0377)] | nxTermHigh[(NXTERMX(r,pr,sr) >> 8) | ((t) >> 8)] : \
+	nxTerm[(t) | NXTERMX(r,pr,sr)])
 
 /* does this row have a subperiod? */
 /* linear time algorithm borrowed from KMP string matching method */
@@ -496,90 +1231,76 @@ static int aperiodic(State s) {
 	return (i == period || ((period % i) != 0));
 }
 
-/* test whether a state can be concluded */
-static int terminal(State s) {
-	int i;
+/* test whether a state is its parent, or grandparent, reflected; sets row_symmetry */
+static int rowSymmetric(State s, State ps) {
+	State pps = parentState(ps);
 	int phase;
-	State ps = parentState(s);
-	unsigned short term = initialTermState;
-	unsigned short nextTerm;
 
-	row_symmetry = none;
-	if (ps == s) return 0;	/* initial state is not terminal */
+	/* test even row symmetry */
+	row_sym_phase_offset = 0;
+	for (phase = 0; phase < period; phase++) if (rowOfState(s, phase) != rowOfState(ps, phase)) break;
+	if (phase == period) {
+		row_symmetry = even;
+		return 1;
+	}
 
-	if (allow_row_sym) {
-		State pps = parentState(ps);
+	/* test odd row symmetry */
+	for (phase = 0; phase < period; phase++) if (rowOfState(s, phase) != rowOfState(pps, phase)) break;
+	if (phase == period) {
+		row_symmetry = odd;
+		return 1;
+	}
 
-		/* test even row symmetry */
-		row_sym_phase_offset = 0;
-		for (phase = 0; phase < period; phase++) if (rowOfState(s, phase) != rowOfState(ps, phase)) break;
+	/* test phase-shifted even row symmetry */
+	if ((period & 1) == 0) {
+		row_sym_phase_offset = period>>1;
+		for (phase = 0; phase < period; phase++)
+			if (rowOfState(s, phase) != rowOfState(ps, (phase + row_sym_phase_offset) % period)) break;
 		if (phase == period) {
 			row_symmetry = even;
 			return 1;
 		}
 
-		/* test odd row symmetry */
-		for (phase = 0; phase < period; phase++) if (rowOfState(s, phase) != rowOfState(pps, phase)) break;
+		/* test phase-shifted odd row symmetry */
+		for (phase = 0; phase < period; phase++)
+			if (rowOfState(s, phase) != rowOfState(pps, (phase + row_sym_phase_offset) % period)) break;
 		if (phase == period) {
 			row_symmetry = odd;
 			return 1;
 		}
-
-		/* test phase-shifted even row symmetry */
-		if ((period & 1) == 0) {
-			row_sym_phase_offset = period>>1;
-			for (phase = 0; phase < period; phase++)
-				if (rowOfState(s, phase) != rowOfState(ps, (phase + row_sym_phase_offset) % period)) break;
-			if (phase == period) {
-				row_symmetry = even;
-				return 1;
-			}
-
-			/* test phase-shifted odd row symmetry */
-			for (phase = 0; phase < period; phase++)
-				if (rowOfState(s, phase) != rowOfState(pps, (phase + row_sym_phase_offset) % period)) break;
-			if (phase == period) {
-				row_symmetry = odd;
-				return 1;
-			}
-		}
 	}
+	return 0;
+}
 
-	/* see if we can finish with some rows of stator */
-	/* the stator itself will be found later */
-	for (i = totalWidth-1; i >= 0; i--) {
-		nextTerm = (unsigned short) -1;
-		if (term == 0) return 0;
-		for (phase = 0; phase < period; phase++) {
-			nextTerm &= NEXTTERM(term,rowOfState(s, phase),rowOfState(ps, phase),rowOfState(s, (phase+1)%period),i);
-		}
-		term = nextTerm;
-	}
-	nextTerm = (unsigned short) -1;
+/* finish the test of whether some rows of stator can follow, at the symmetry axis */
+#define TERM_INLINE static inline __attribute__((always_inline))
+TERM_INLINE int terminalEdge(int split, unsigned short term, State s, State ps) {
+	unsigned short nextTerm = (unsigned short) -1;
+	int phase;
 	switch (symmetry) {
 		case odd:
 			for (phase = 0; phase < period; phase++)
-				nextTerm &= NEXTTERM(term,ODDEXT(rowOfState(s, phase)),ODDEXT(rowOfState(ps, phase)),
-										   rowOfState(s, (phase+1)%period)<<1,0);
+				nextTerm &= NEXTTERM(split,term,ODDEXT(rowOfState(s, phase)),ODDEXT(rowOfState(ps, phase)),
+									   rowOfState(s, (phase+1)%period)<<1,0);
 			if (revTerm[nextTerm] & term) return 1;
 			return 0;
 
 		case even:
 			for (phase = 0; phase < period; phase++)
-				nextTerm &= NEXTTERM(term,EVEXT(rowOfState(s, phase)),EVEXT(rowOfState(ps, phase)),
-										   rowOfState(s, (phase+1)%period)<<1,0);
+				nextTerm &= NEXTTERM(split,term,EVEXT(rowOfState(s, phase)),EVEXT(rowOfState(ps, phase)),
+									   rowOfState(s, (phase+1)%period)<<1,0);
 			if (revTerm[nextTerm] & nextTerm) return 1;
 			return 0;
 
 		case none:
 			for (phase = 0; phase < period; phase++)
-				nextTerm &= NEXTTERM(term,rowOfState(s, phase)<<1,rowOfState(ps, phase)<<1,
-										   rowOfState(s, (phase+1)%period)<<1,0);
+				nextTerm &= NEXTTERM(split,term,rowOfState(s, phase)<<1,rowOfState(ps, phase)<<1,
+									   rowOfState(s, (phase+1)%period)<<1,0);
 			term = nextTerm;
 			nextTerm = (unsigned short) -1;
 			for (phase = 0; phase < period; phase++)
-				nextTerm &= NEXTTERM(term,rowOfState(s, phase)<<2,rowOfState(ps, phase)<<2,
-										   rowOfState(s, (phase+1)%period)<<2,0);
+				nextTerm &= NEXTTERM(split,term,rowOfState(s, phase)<<2,rowOfState(ps, phase)<<2,
+									   rowOfState(s, (phase+1)%period)<<2,0);
 			if (revTerm[nextTerm] & initialTermState) return 1;
 			return 0;
 	}
@@ -589,20 +1310,108 @@ static int terminal(State s) {
 	return 1;
 }
 
-/* find stator to finish off possible asym stator detected by terminal() */
-/* BT(col,i,j) counts min #cells in stator through given col w/last two cols = i, j */
-/* PT(col,i,j) gives the preceding column leading to BT(col,i,j) */
-short bestTerm[1<<16];
-char predTerm[1<<16];
-char tcompat[1<<15];
-char tcompat3[1<<9];
-char stabtab[1<<13];
-int fwdBestTerm, backBestTerm;
-#define BT(col,i,j) bestTerm[(((col)+2)<<10)|((i)<<5)|(j)]
-#define PT(col,i,j) predTerm[(((col)+2)<<10)|((i)<<5)|(j)]
-#define tcompatible(i,j,k) tcompat[((i)<<10)|((j)<<5)|(k)]
-#define tcomp3(i,j,k) tcompat3[(((i)&7)<<6)|(((j)&7)<<3)|((k)&7)]
-int bitCount[32];
+/* test whether a state can be concluded */
+TERM_INLINE int terminalWith(int split, State s) {
+	int i;
+	int phase;
+	State ps = parentState(s);
+	unsigned short term = initialTermState;
+	unsigned short nextTerm;
+
+	row_symmetry = none;
+	if (ps == s) return 0;	/* initial state is not terminal */
+	if (allow_row_sym && rowSymmetric(s, ps)) return 1;
+
+	/* see if we can finish with some rows of stator */
+	/* the stator itself will be found later */
+	for (i = totalWidth-1; i >= 0; i--) {
+		nextTerm = (unsigned short) -1;
+		if (term == 0) return 0;
+		for (phase = 0; phase < period; phase++) {
+			nextTerm &= NEXTTERM(split,term,rowOfState(s, phase),rowOfState(ps, phase),rowOfState(s, (phase+1)%period),i);
+		}
+		term = nextTerm;
+	}
+	return terminalEdge(split, term, s, ps);
+}
+
+static int terminal(State s) {
+	return splitTerm ? terminalWith(1, s) : terminalWith(0, s);
+}
+
+/*
+** The same test as terminal() for each of n consecutive states from first,
+** setting isTerminal[] to the answers.  Most of the time goes in the nxTerm
+** lookups, which mostly miss the cache, and each column's lookups depend on
+** the previous column's, so the states are stepped through the columns
+** together: the lookups for different states are independent and their
+** misses overlap.  A state drops out of the walk as soon as no stator can
+** follow it.  row_symmetry is left as set for the last state.
+*/
+#define TERMBATCH 16
+TERM_INLINE void terminalBlockWith(int split, State first, int n, unsigned char * isTerminal) {
+	State st[TERMBATCH], pst[TERMBATCH];
+	unsigned short term[TERMBATCH];
+	int live[TERMBATCH];
+	int nLive = 0;
+	int i, j, phase;
+	State s = first;
+
+	for (j = 0; j < n; j++, s = nextState(s)) {
+		State ps = parentState(s);
+		isTerminal[j] = 0;
+		row_symmetry = none;
+		if (ps == s) continue;	/* initial state is not terminal */
+		if (allow_row_sym && rowSymmetric(s, ps)) {
+			isTerminal[j] = 1;
+			continue;
+		}
+		if (initialTermState == 0) continue;
+		st[j] = s;
+		pst[j] = ps;
+		term[j] = initialTermState;
+		live[nLive++] = j;
+	}
+
+	/* see if we can finish with some rows of stator */
+	/* the stator itself will be found later */
+	for (i = totalWidth-1; i >= 0 && nLive > 0; i--) {
+		int k = 0;
+		for (j = 0; j < nLive; j++) {
+			int b = live[j];
+			unsigned short nextTerm = (unsigned short) -1;
+			for (phase = 0; phase < period; phase++)
+				nextTerm &= NEXTTERM(split,term[b],rowOfState(st[b], phase),rowOfState(pst[b], phase),
+									 rowOfState(st[b], (phase+1)%period),i);
+			term[b] = nextTerm;
+			if (nextTerm) live[k++] = b;
+		}
+		nLive = k;
+	}
+	for (j = 0; j < nLive; j++)
+		isTerminal[live[j]] = terminalEdge(split, term[live[j]], st[live[j]], pst[live[j]]);
+}
+
+static void terminalBlock(State first, int n, unsigned char * isTerminal) {
+	if (splitTerm) terminalBlockWith(1, first, n, isTerminal);
+	else terminalBlockWith(0, first, n, isTerminal);
+}
+
+/* find stator to finish off possible asym stator detected by terminal() */
+/* BT(col,i,j) counts min #cells in stator through given col w/last two cols = i, j */
+/* PT(col,i,j) gives the preceding column leading to BT(col,i,j) */
+#define TERMCOLS (MAXWIDTH+32)	/* columns -2..TERMCOLS-3 */
+short bestTerm[TERMCOLS<<10];
+char predTerm[TERMCOLS<<10];
+char tcompat[1<<15];
+char tcompat3[1<<9];
+char stabtab[1<<13];
+int fwdBestTerm, backBestTerm;
+#define BT(col,i,j) bestTerm[(((col)+2)<<10)|((i)<<5)|(j)]
+#define PT(col,i,j) predTerm[(((col)+2)<<10)|((i)<<5)|(j)]
+#define tcompatible(i,j,k) tcompat[((i)<<10)|((j)<<5)|(k)]
+#define tcomp3(i,j,k) tcompat3[(((i)&7)<<6)|(((j)&7)<<3)|((k)&7)]
+int bitCount[32];
 
 static int terminateCols(int backCol, int fwdCol)
 {
@@ -621,15 +1430,27 @@ static int terminateCols(int backCol, int fwdCol)
 	return (bestCount < 0x7fff);
 }
 
-static int stabilizes(int i, int j, int k, State s, int col)
+/*
+** Whether stator columns i, j and k can stay stable next to the rotor at col
+** depends only on their low two bits and on bits col to col+2 of the rows,
+** so stabMask() works it out for all 64 values of the low bits of i, j and
+** k at once, as bit (i&3)<<4 | (j&3)<<2 | (k&3) of its result.  stabBits[v]
+** has that bit set when stabtab[] allows it with row bits v, and termCompat
+** has bit k of entry i<<5 | j set when tcompatible(i,j,k).
+*/
+uint64_t stabBits[1<<7];
+uint32_t termCompat[1<<10];
+
+static uint64_t stabMask(State s, int col)
 {
+	uint64_t mask = ~(uint64_t) 0;
 	int phase;
-	int ijk = ((i&3)<<11) | ((j&3)<<9) | ((k&3)<<7);
 	for (phase = 0; phase < period; phase++) {
 		Row r = rowOfState(s, phase);
 		Row pr = rowOfState(parentState(s), phase);
 		Row sr = rowOfState(s, (phase+1)%period);
-		if (col >= 0) {
+		if (col >= ROWBITS) r = pr = sr = 0;
+		else if (col >= 0) {
 			r >>= col;
 			pr >>= col;
 			sr >>= col;
@@ -650,38 +1471,65 @@ static int stabilizes(int i, int j, int k, State s, int col)
 				sr <<= -col;
 				break;
 		}
-		if (!stabtab[ijk | ((r&7)<<4) | ((pr&7)<<1) | ((sr>>1)&1)])
-			return 0;
+		mask &= stabBits[((r&7)<<4) | ((pr&7)<<1) | ((sr>>1)&1)];
 	}
-	return 1;
+	return mask;
 }
 
+/*
+** The columns of BT are worked out from the outside in, and a column only
+** depends on the columns outside it and on its stabMask().  The states that
+** reach terminate() are often siblings sharing their outer columns, or have
+** none there at all, so the masks used last time are kept in termMasks[]
+** and the columns down to the first one whose mask differs are reused.
+*/
+uint64_t termMasks[TERMCOLS];
+int termStart = TERMCOLS;	/* first column of the last call, or TERMCOLS if none */
+int termLow;	/* last column of BT that call worked out */
+int termFailed;	/* did it stop at termLow for want of any stator? */
+
 static int terminate(State s) {
 	int i,j;
-	int col = totalWidth + addlStatorCols;
+	int start = totalWidth + addlStatorCols;
+	int col;
 	int lastCol = -1;
 
 
 	if (symmetry == none) lastCol = -2;
-	if (col > 63) col = 63;
-	for (i = 0; i < 32; i++) for (j = 0; j < 32; j++) BT(col,i,j) = -1;
-	BT(col,0,0) = 0;	/* empty stator has no cells */
-	PT(col,0,0) = 0;  /* and predecessor is also empty */
+	if (start > TERMCOLS-3) start = TERMCOLS-3;
+	col = start;
+	if (start == termStart) {
+		while (col > termLow && stabMask(s, col-1) == termMasks[col-1+2]) col--;
+		if (col == termLow && termFailed) return 0;
+	}
+	if (col == start) {
+		for (i = 0; i < 32; i++) for (j = 0; j < 32; j++) BT(col,i,j) = -1;
+		BT(col,0,0) = 0;	/* empty stator has no cells */
+		PT(col,0,0) = 0;  /* and predecessor is also empty */
+	}
 	while (col > lastCol) {
 		int foundAny = 0;
+		uint64_t mask;
 		col--;
+		mask = termMasks[col+2] = stabMask(s, col);
+		termStart = start;
+		termLow = col;
 		for (i = 0; i < 32; i++) for (j = 0; j < 32; j++) BT(col,i,j) = -1;
 		for (i = 0; i < 32; i++) for (j = 0; j < 32; j++) if (BT(col+1,i,j) >= 0) {
-			int k;
-			for (k = 0; k < 32; k++) {
-				if (tcompatible(i,j,k) && BT(col+1,i,j)+bitCount[k] < (BT(col,j,k)&0x7fff) &&
-					 	stabilizes(i,j,k,s,col)) {
+			/* k compatible with i and j, and stable */
+			uint32_t ks = termCompat[(i<<5)|j] &
+				(uint32_t) ((mask >> (((i&3)<<4) | ((j&3)<<2))) & 15) * 0x11111111u;
+			while (ks != 0) {
+				int k = __builtin_ctz(ks);
+				ks &= ks - 1;
+				if (BT(col+1,i,j)+bitCount[k] < (BT(col,j,k)&0x7fff)) {
 					BT(col,j,k) = BT(col+1,i,j)+bitCount[k];
 					PT(col,j,k) = i;
 					foundAny = 1;
 				}
 			}
 		}
+		termFailed = !foundAny;
 		if (!foundAny) return 0;
 	}
 	switch (symmetry) {
@@ -695,6 +1543,34 @@ static int terminate(State s) {
 	return 0;	/* never reached */
 }
 
+/* derive stabBits and termCompat from stabtab and tcompat; cheap enough not to cache */
+static void initTermMasks()
+{
+	int v, ijk, i, k;
+	for (v = 0; v < (1<<7); v++) {
+		stabBits[v] = 0;
+		for (ijk = 0; ijk < 64; ijk++)
+			if (stabtab[(ijk<<7) | v]) stabBits[v] |= (uint64_t) 1 << ijk;
+	}
+	for (i = 0; i < (1<<10); i++) {
+		termCompat[i] = 0;
+		for (k = 0; k < 32; k++)
+			if (tcompat[(i<<5) | k]) termCompat[i] |= (uint32_t) 1 << k;
+	}
+	termStart = TERMCOLS;
+}
+
+/* split nxTerm into the halves used with -H y; cheap enough not to cache */
+static void initSplitTerm()
+{
+	long x, t;
+	for (x = 0; x < (1<<6); x++)
+		for (t = 0; t < (1<<8); t++) {
+			nxTermLow[(x<<8) | t] = nxTerm[(x<<16) | t];
+			nxTermHigh[(x<<8) | t] = nxTerm[(x<<16) | (t<<8)];
+		}
+}
+
 /* initializations for terminal() and terminate() */
 static void initTermTabs()
 {
@@ -795,7 +1671,12 @@ static void initTermTabs()
 		for (j = 0; j < 16; j++) if (i & (1<<j)) nxTerm[i] |= nti[(i>>16)|(j<<6)];
 	}
 
-	/* what states can terminate empty pattern?  and how many cols needed to stabilize?  */
+}
+
+/* what states can terminate empty pattern?  and how many cols needed to stabilize?  */
+/* unlike the tables above, this depends on zeroLotLine as well as the rule */
+static void initTermState()
+{
 	initialTermState = 1;
 	addlStatorCols = 0;
 	if (!zeroLotLine) for (;;) {
@@ -822,13 +1703,12 @@ static void putStator(int row, int col, int i, int j, int reversed, int skip)
 	if (skip <= 0 && !reversed) putCell(j,row);
 }
 
-/* found a pattern, output it */
-static void success(State s) {
+/* output a found pattern to patternOut */
+static void putPattern(State s) {
 	int i=0, j;
-	if (row_symmetry == none && !terminate(s)) return;	/* incomplete success */
-
-	putchar('\n');	/* make initial blank row in output */
+	putc('\n', patternOut);	/* make initial blank row in output */
 	while (parentState(s) != s && s != 0) {
+		rows = growArray(rows, &rowsSize, 2*i+2, sizeof(Row));
 		rows[2*i] = rowOfState(s, 0);
 		rows[2*i+1] = rowOfState(s, row_sym_phase_offset);
 		i++;
@@ -842,36 +1722,276 @@ static void success(State s) {
 		case even:
 			i = 2;
 			while (i < j) putRow(rows[2*(i++)+1]);
-			exit(0);
+			return;
 		case odd:
 			i = 3;
 			while (i < j) putRow(rows[2*(i++)+1]);
-			exit(0);
+			return;
 	}
 	switch(symmetry) {
 		case odd:
 			for (i = 0; i < 5; i++) {
 				putStator(i,0,fwdBestTerm,backBestTerm,0,1);
 				putStator(i,-1,backBestTerm,fwdBestTerm,1,1);
-				putchar('\n');
+				putc('\n', patternOut);
 			}
 			break;
 		case even:
 			for (i = 0; i < 5; i++) {
 				putStator(i,-1,fwdBestTerm,backBestTerm,0,1);
 				putStator(i,-1,backBestTerm,fwdBestTerm,1,1);
-				putchar('\n');
+				putc('\n', patternOut);
 			}
 			break;
 		case none:
 			for (i = 0; i < 5; i++) {
 				putStator(i,totalWidth,backBestTerm,fwdBestTerm,0,1);
 				putStator(i,-2,fwdBestTerm,backBestTerm,1,1);
-				putchar('\n');
+				putc('\n', patternOut);
 			}
 			break;
 	}
-	exit(0);
+}
+
+/*
+** Normally the search ends with the first pattern found.  With -n the
+** search goes on until that many distinct patterns have been printed (or
+** the queue runs out, with -n 0), so the work up to the first pattern is
+** shared by all of them.  Each pattern is rendered to memory first, and
+** one printed before is recognized by a hash of its text, kept in a set
+** with open addressing and linear probing that doubles when half full.
+*/
+int maxResults = 1;
+long nResults = 0;
+uint64_t * resultHashes;	/* 0 for an empty slot */
+long resultHashSize = 0;
+
+static int newResult(char * text, size_t len) {
+	uint64_t h = 14695981039346656037ULL;	/* FNV-1a */
+	long i, j;
+	while (len-- > 0) h = (h ^ (unsigned char) *text++) * 1099511628211ULL;
+	if (h == 0) h = 1;
+	if (2 * (nResults + 1) > resultHashSize) {
+		uint64_t * old = resultHashes;
+		long oldSize = resultHashSize;
+		resultHashSize = oldSize ? 2 * oldSize : 1024;
+		resultHashes = calloc(resultHashSize, sizeof(uint64_t));
+		if (resultHashes == 0) {
+			fprintf(stderr,"Unable to allocate memory, aborting.\n");
+			failure();
+		}
+		for (i = 0; i < oldSize; i++) if (old[i] != 0) {
+			j = old[i] & (resultHashSize - 1);
+			while (resultHashes[j] != 0) j = (j + 1) & (resultHashSize - 1);
+			resultHashes[j] = old[i];
+		}
+		free(old);
+	}
+	for (i = h & (resultHashSize - 1); resultHashes[i] != 0; i = (i + 1) & (resultHashSize - 1))
+		if (resultHashes[i] == h) return 0;
+	resultHashes[i] = h;
+	nResults++;
+	return 1;
+}
+
+/*
+** With -o, each distinct pattern found is also written to a file, or with
+** -o tcp:host:port to a socket, for loading into a pattern collection
+** without scraping standard output.  -f rle (the default) writes an RLE
+** record with the period in a comment and the rule in its header; -f bin
+** writes a binary record made of little-endian fields:
+**   uint32 magic "OFR1", number of bytes in the rest of the record
+**   uint32 rule (bits 0-8 survival, 9-17 birth), period, symmetry
+**          (0 none, 1 odd, 2 even), width of the rows, number of rows n
+**   uint64 rows[n][period]: the search line, top row first, one row per
+**          phase with the low bit at the axis of symmetry
+**   uint32 width w and height h of the pattern as printed, stator included
+**   h rows of (w+7)/8 bytes, leftmost cell in the low bit of the first byte
+** The destination is opened at the first pattern, so that each job of -j
+** gets its own, and written through a large buffer that is flushed at
+** each compaction and when ofind exits.
+*/
+char * resultPath = 0;
+int resultBinary = 0;
+FILE * resultOut = 0;
+uint64_t * resultRows;
+long resultRowsSize = 0;
+
+static void openResults() {
+	char * port;
+	if (!strncmp(resultPath, "tcp:", 4) && (port = strrchr(resultPath + 4, ':')) != 0) {
+		struct addrinfo hints, * ai, * a;
+		char host[256];
+		int fd = -1;
+		snprintf(host, sizeof host, "%.*s", (int) (port - resultPath - 4), resultPath + 4);
+		memset(&hints, 0, sizeof hints);
+		hints.ai_socktype = SOCK_STREAM;
+		if (getaddrinfo(host, port + 1, &hints, &ai) == 0) {
+			for (a = ai; a != 0 && fd < 0; a = a->ai_next) {
+				fd = socket(a->ai_family, a->ai_socktype, a->ai_protocol);
+				if (fd >= 0 && connect(fd, a->ai_addr, a->ai_addrlen) < 0) {
+					close(fd);
+					fd = -1;
+				}
+			}
+			freeaddrinfo(ai);
+		}
+		signal(SIGPIPE, SIG_IGN);	/* a closed connection shows up as a write error */
+		if (fd >= 0) resultOut = fdopen(fd, "w");
+	} else resultOut = fopen(resultPath, "a");
+	if (resultOut == 0) {
+		fprintf(stderr,"Unable to write results to %s\n", resultPath);
+		exit(1);
+	}
+	setvbuf(resultOut, 0, _IOFBF, 1<<16);
+}
+
+static void flushResults() {
+	if (resultOut && fflush(resultOut) != 0) {
+		fprintf(stderr,"Unable to write results to %s\n", resultPath);
+		resultOut = 0;
+		resultPath = 0;
+	}
+}
+
+/* write the rule as Bxxx/Syyy */
+static char * ruleString(char * buf) {
+	char * p = buf;
+	int i;
+	*p++ = 'B';
+	for (i = 0; i < 9; i++) if (rule & (1 << (9+i))) *p++ = '0' + i;
+	*p++ = '/';
+	*p++ = 'S';
+	for (i = 0; i < 9; i++) if (rule & (1 << i)) *p++ = '0' + i;
+	*p = '\0';
+	return buf;
+}
+
+/* write n copies of c to an RLE line, wrapping it at 70 characters */
+static void putRun(int n, char c, int * col) {
+	char buf[16];
+	int len = n > 1 ? snprintf(buf, sizeof buf, "%d%c", n, c) : snprintf(buf, sizeof buf, "%c", c);
+	if (*col + len > 70) {
+		putc('\n', resultOut);
+		*col = 0;
+	}
+	fputs(buf, resultOut);
+	*col += len;
+}
+
+static void putLE(uint64_t x, int bytes) {
+	while (bytes-- > 0) {
+		putc(x & 0xff, resultOut);
+		x >>= 8;
+	}
+}
+
+/* write the pattern s, printed as the lines in text, to resultOut */
+static void writeResult(State s, char * text, size_t len) {
+	char * end = text + len;
+	char * p;
+	char buf[32];
+	long n = 0, i;
+	int w = 0, h = 0, x = 0, ends = 0, col = 0;
+	int phase;
+
+	while (text < end && *text == '\n') text++;	/* blank line before the pattern */
+	for (p = text; p < end; p++) {
+		if (*p != '\n') x++;
+		if (*p == '\n' || p+1 == end) {
+			if (x > w) w = x;
+			x = 0;
+			h++;
+		}
+	}
+	if (resultOut == 0) openResults();
+	if (!resultBinary) {
+		fprintf(resultOut, "#C ofind period %d\nx = %d, y = %d, rule = %s\n", period, w, h, ruleString(buf));
+		for (p = text; p < end; p += x) {
+			if (*p == '\n') {
+				ends++;
+				x = 1;
+				continue;
+			}
+			for (x = 1; p+x < end && p[x] == *p; x++) ;
+			if (*p != 'o' && (p+x == end || p[x] == '\n')) continue;	/* dead to the end of the line */
+			if (ends) putRun(ends, '$', &col);
+			ends = 0;
+			putRun(x, *p == 'o' ? 'o' : 'b', &col);
+		}
+		fputs("!\n", resultOut);
+		return;
+	}
+
+	for (; parentState(s) != s && s != 0; s = parentState(s)) {
+		resultRows = growArray(resultRows, &resultRowsSize, (n+1) * period, sizeof(uint64_t));
+		for (phase = 0; phase < period; phase++) resultRows[n*period + phase] = rowOfState(s, phase);
+		n++;
+	}
+	fputs("OFR1", resultOut);
+	putLE(4*5 + 8*n*period + 4*2 + (long) h * ((w+7)/8), 4);
+	putLE(rule, 4);
+	putLE(period, 4);
+	putLE(symmetry, 4);
+	putLE(totalWidth, 4);
+	putLE(n, 4);
+	for (i = n; i-- > 0; )
+		for (phase = 0; phase < period; phase++) putLE(resultRows[i*period + phase], 8);
+	putLE(w, 4);
+	putLE(h, 4);
+	for (p = text; h-- > 0; p++) {	/* one line per row, then its newline */
+		int byte = 0;
+		for (x = 0; x < (w+7)/8*8; x++) {
+			if (p < end && *p != '\n' && x < w) byte |= (*p++ == 'o') << (x&7);
+			if ((x&7) == 7) {
+				putc(byte, resultOut);
+				byte = 0;
+			}
+		}
+	}
+}
+
+/* found a pattern, output it */
+/* may be called by deepening workers, so only one thread at a time gets past the lock */
+static pthread_mutex_t successLock = PTHREAD_MUTEX_INITIALIZER;
+static void success(State s) {
+	char * text;
+	size_t len;
+	int complete = 1;
+	STAT_TIMER(t);
+	pthread_mutex_lock(&successLock);
+	if (row_symmetry == none) {
+		STAT_START(t);
+		complete = terminate(s);
+		STAT_STOP(STAGE_TERMINATE, t);
+	}
+	if (!complete) {	/* incomplete success */
+		pthread_mutex_unlock(&successLock);
+		return;
+	}
+	if (maxResults == 1 && resultPath == 0) {
+		putPattern(s);
+		exit(0);
+	}
+	patternOut = open_memstream(&text, &len);
+	if (patternOut == 0) {
+		fprintf(stderr,"Unable to allocate memory, aborting.\n");
+		exit(1);
+	}
+	putPattern(s);
+	fclose(patternOut);
+	patternOut = stdout;
+	if (newResult(text, len)) {
+		fputs(text, stdout);
+		fflush(stdout);
+		if (resultPath) writeResult(s, text, len);
+		if (nResults == maxResults) {
+			if (maxResults > 1) printf("\n%ld patterns found\n", nResults);
+			exit(0);
+		}
+	}
+	free(text);
+	pthread_mutex_unlock(&successLock);
 }
 
 /* didn't find a pattern, output anyway */
@@ -884,7 +2004,7 @@ static void failure() {
 			s = parentState(s);
 		}
 	} else printf("\nUnable to find current search line.\n");
-	exit(0);
+	exit(failureStatus);
 }
 
 static void printstatus() {
@@ -911,48 +2031,95 @@ static int nontrivial(State s) {
 /*  Compute successors of a given state and append them to state space  */
 /* ==================================================================== */
 
+/* children made by a worker thread are held here until merged into the queue */
+/* each child uses the same layout as in statespace: parent then one row per phase */
+typedef struct {
+	State first, last;	/* range of frontier states expanded into this block */
+	Row * children;
+	long nChildren, childSize;
+	State * found;	/* states that passed terminal() and nontrivial() */
+	long nFound, foundSize;
+} ChildBlock;
+THREADLOCAL ChildBlock * childBlock;	/* null when children go straight to the queue */
+
+static void * growArray(void * p, long * size, long needed, size_t eltSize)
+{
+	if (needed <= *size) return p;
+	if (*size == 0) *size = 1024;
+	while (*size < needed) *size *= 2;
+	p = realloc(p, *size * eltSize);
+	if (p == 0) {
+		fprintf(stderr,"Unable to allocate memory, aborting.\n");
+		failure();
+	}
+	return p;
+}
+
 /* make new state out of given row indices */
 /* stator/rotor check is here for now */
 static void makeNewState(State parent) {
 	State s = firstFreeState;
 	int phase;
-	setParentState(s, parent);
-	firstFreeState = nextState(s);	/* make sure we're not at end of array */
-	for (phase = 0; phase < period; phase++)
-		setRowOfState(s, phase, rows[firstRow[phase]+rowIndices[phase]]);
 	if (parentState(parent) == parent) {
 		int nonzero = 0;
 		for (phase = 0; phase < period && !nonzero; phase++)
-			if(rowOfState(s, phase)) nonzero++;
-		if (!nonzero) {
-			firstFreeState = s;	/* zero successor of zero, abort */
-			return;
-		}
+			if (rows[firstRow[phase]+rowIndices[phase]]) nonzero++;
+		if (!nonzero) return;	/* zero successor of zero, abort */
+	}
+	if (childBlock) {	/* running in a worker, duplicates are tested when merged */
+		Row * c;
+		childBlock->children = growArray(childBlock->children, &childBlock->childSize,
+										 (childBlock->nChildren+1)*(period+1), sizeof(Row));
+		c = childBlock->children + childBlock->nChildren*(period+1);
+		c[0] = parent;
+		for (phase = 0; phase < period; phase++)
+			c[1+phase] = rows[firstRow[phase]+rowIndices[phase]];
+		childBlock->nChildren++;
+		return;
 	}
+	if (scratchEnd && s + stateSize > scratchEnd) {	/* deepen() retries the state on one thread */
+		scratchFull = 1;
+		return;
+	}
+	setParentState(s, parent);
+	firstFreeState = nextState(s);	/* make sure we're not at end of array */
+	for (phase = 0; phase < period; phase++)
+		setRowOfState(s, phase, rows[firstRow[phase]+rowIndices[phase]]);
 	if (hashing && hash(s)) firstFreeState = s;	/* test if duplicate, and if so abort new state */
 }
 
 /* handle subset of rows having a common stator */
 static void processGroup(State s)
 {
-	int phase;
+	int phase, live;
+	STAT_TIMER(t);
 #ifdef DEBUG
 		int i;
 #endif
 
-	/* set up compatibility information for extensions in adjacent phases */
+	/* set up compatibility information for extensions in adjacent phases, */
+	/* giving up as soon as a phase has no row that can follow the one before */
+	STAT_START(t);
 	for (phase = 0; phase < period; phase++) {
-		int i, j;
-		int prevPhase = phase - 1;
-		if (prevPhase < 0) prevPhase = period - 1;
+		int j;
+		Row any = 0;
 		rowIndices[phase] = -1;
-		for (i = 0; i < nRows[prevPhase]; i++)
-			for (j = 0; j < nRows[phase]; j++)
-				testCompatible(phase, firstRow[prevPhase]+i, firstRow[phase]+j, s);
+		for (j = 0; j < nRows[phase]; j++)
+			any |= testCompatible(phase, firstRow[phase]+j, s);
+		if (!any) break;
 	}
+	STAT_STOP(STAGE_COMPAT, t);
+	if (phase < period) return;
+	STAT_START(t);
+	live = pruneRows();
+	STAT_STOP(STAGE_PRUNE, t);
+	if (!live) return;
+	STAT_START(t);
 	testReachable();
+	STAT_STOP(STAGE_REACH, t);
 
 	/* loop through all sequences of compatible extension rows */
+	STAT_START(t);
 	phase = -1;
 	for (;;) {
 		NICE();
@@ -960,7 +2127,10 @@ static void processGroup(State s)
 		while (rowIndices[phase] == nRows[phase]-1) {
 			rowIndices[phase] = -1;
 			phase--;
-			if (phase < 0) return;
+			if (phase < 0) {
+				STAT_STOP(STAGE_GROUP, t);
+				return;
+			}
 		}
 		rowIndices[phase]++;
 #ifdef DEBUG
@@ -997,23 +2167,68 @@ static void processGroup(State s)
 	}
 }
 
-/* qsort subroutine to sort rows by stator type */
-/* ties are broken in favor of smaller rotor since qsort appears to be unstable */
-static int statorCompare(const void * p, const void * q)
+/*
+** Sort rows by stator, keeping rows with equal stators in increasing order
+** as qsort() with a comparator that broke ties by rotor did.  listRows()
+** already produces rows in increasing order, so a stable sort on the stator
+** bits alone is enough: insertion sort for short lists, otherwise an LSD
+** radix sort, 8 bits at a time, on the stator bits packed together.  With
+** no left stator the stator is the top bits of the row, so the list is
+** sorted already.
+*/
+THREADLOCAL Row * sortBuffer;
+THREADLOCAL long sortBufferSize;
+
+static Row statorKey(Row r)
+{
+	int right = rotorWidth+leftStatorWidth;
+	Row key = r & lowBits(leftStatorWidth);
+	if (right < ROWBITS) key |= (r >> right) << leftStatorWidth;
+	return key;
+}
+
+static void sortByStator(Row * r, int n)
 {
-	Row pr = *(Row *)p;
-	Row qr = *(Row *)q;
-	if ((pr&STATMASK) != (qr&STATMASK))
-		return (int) ((pr&STATMASK) - (qr&STATMASK));
-	return (int) (pr-qr);
+	int keyBits = leftStatorWidth + rightStatorWidth;
+	int shift, i;
+	Row * from = r;
+	Row * to;
+	if (leftStatorWidth == 0) return;
+	if (n < 32) {
+		for (i = 1; i < n; i++) {
+			Row x = r[i];
+			Row k = statorKey(x);
+			int j = i;
+			while (j > 0 && statorKey(r[j-1]) > k) {
+				r[j] = r[j-1];
+				j--;
+			}
+			r[j] = x;
+		}
+		return;
+	}
+	sortBuffer = growArray(sortBuffer, &sortBufferSize, n, sizeof(Row));
+	to = sortBuffer;
+	for (shift = 0; shift < keyBits; shift += 8) {
+		int count[257];
+		Row * t;
+		for (i = 0; i <= 256; i++) count[i] = 0;
+		for (i = 0; i < n; i++) count[((statorKey(from[i]) >> shift) & 0xff) + 1]++;
+		for (i = 0; i < 256; i++) count[i+1] += count[i];
+		for (i = 0; i < n; i++) to[count[(statorKey(from[i]) >> shift) & 0xff]++] = from[i];
+		t = from;
+		from = to;
+		to = t;
+	}
+	if (from != r) memcpy(r, from, n * sizeof(Row));
 }
 
 /* find a single stator group */
-int lastRow[MAXPERIOD];
-int currentRow[MAXPERIOD];
+THREADLOCAL int lastRow[MAXPERIOD];
+THREADLOCAL int currentRow[MAXPERIOD];
 static void findStatorGroup(State s) {
 	int phase;
-	Row stator;
+	Row stator = 0;
 
 	for (phase = 0; phase < period; phase++) {
 		/* move past previous stator groups */
@@ -1054,11 +2269,13 @@ static void findStatorGroup(State s) {
 	processGroup(s);
 }
 
-/* main entry to enqueue all children of a search node */
-static void process(State s)
+/* enqueue all children of a search node, given whether terminal() holds for it */
+/* callers count the state in the Stats first */
+static void expand(State s, int isTerminal)
 {
 	int phase;
 	Row sparkMask = -1L;
+	STAT_TIMER(t);
 #ifdef DEBUG
 	printf("processing");
 	for (phase = 0; phase < period; phase++)
@@ -1068,7 +2285,17 @@ static void process(State s)
 	NICE();
 
 	/* check if we've finished the search! if so, success doesn't return */
-	if (terminal(s) && nontrivial(s)) success(s);
+	/* workers leave the check to the main thread, in queue order */
+	if (isTerminal && nontrivial(s)) {
+		if (childBlock) {
+			childBlock->found = growArray(childBlock->found, &childBlock->foundSize,
+										  childBlock->nFound+1, sizeof(State));
+			childBlock->found[childBlock->nFound++] = s;
+		} else {
+			terminal(s);	/* recompute row_symmetry, which terminalBlock() leaves for its last state */
+			success(s);
+		}
+	}
 
 	/* determine how many rows of the state should be treated as sometimes-present sparks */
 	if (sparkLevel) {
@@ -1088,9 +2315,11 @@ static void process(State s)
 	for (phase = 0; phase < period; phase++) {
 		if (phase == 0) firstRow[phase] = 0;
 		else firstRow[phase] = firstRow[phase-1]+nRows[phase-1];
-		nRows[phase] = 0;
-		setupExtensions(rowOfState(s, phase),rowOfState(parentState(s), phase),rowOfState(s, (phase+1)%period),sparkMask);
-		listRows(0,phase,totalWidth-1,03);
+		STAT_START(t);
+		nRows[phase] = cachedRows(phase, rowOfState(s, phase), rowOfState(parentState(s), phase),
+								  rowOfState(s, (phase+1)%period), sparkMask);
+		STAT_STOP(STAGE_LISTROWS, t);
+		STAT_ADD(rowsListed[phase], nRows[phase]);
 		if (nRows[phase] == 0) return;	/* no possible extensions in this phase */
 	}
 
@@ -1106,7 +2335,7 @@ static void process(State s)
 #ifdef DEBUG
 		printf("All rows, phase %d, firstRow=%d, nRows=%d\n", phase, firstRow[phase], nRows[phase]);
 #endif
-		qsort(rows+firstRow[phase], nRows[phase], sizeof(Row), statorCompare);
+		sortByStator(rows+firstRow[phase], nRows[phase]);
 		lastRow[phase] = firstRow[phase]+nRows[phase];
 		currentRow[phase] = firstRow[phase];
 		nRows[phase] = 0;
@@ -1115,78 +2344,470 @@ static void process(State s)
 	while (firstRow[0]+nRows[0] < lastRow[0]) findStatorGroup(s);
 }
 
-/* ============================== */
-/*  Depth first search algorithm  */
-/* ============================== */
-
-#define unused -1
+/* main entry to enqueue all children of a search node */
+static void process(State s)
+{
+	int isTerminal;
+	STAT_TIMER(t);
+	STAT_ADD(states, 1);
+	STAT_SAMPLE();
+	STAT_START(t);
+	isTerminal = terminal(s);
+	STAT_STOP(STAGE_TERMINAL, t);
+	expand(s, isTerminal);
+}
 
-static int depthFirst(State s, int numLevels) {
-	State f = firstFreeState;
-	NICE();
-	if (numLevels == 0) return 1;
-	process(s);
-	while (f < firstFreeState) {
-		State child = previousState(firstFreeState);
-		if (depthFirst(child, numLevels - 1)) {
-			firstFreeState = f;
-			return 1;
+/* process the consecutive states from first up to last, testing them for terminal() together */
+static void processBlock(State first, State last)
+{
+	unsigned char isTerminal[TERMBATCH];
+	STAT_TIMER(t);
+	while (first < last) {
+		State s = first;
+		int n, i;
+		for (n = 0; n < TERMBATCH && s < last; n++) s = nextState(s);
+		STAT_START_ALWAYS(t);
+		terminalBlock(first, n, isTerminal);
+		STAT_STOP_ALWAYS(STAGE_TERMINAL, t, n);
+		for (i = 0; i < n; i++, first = nextState(first)) {
+			STAT_ADD(states, 1);
+			STAT_SAMPLE();
+			expand(first, isTerminal[i]);
 		}
-		firstFreeState = child;
 	}
-	firstFreeState = f;
+}
+
+/* ================ */
+/*  Worker threads  */
+/* ================ */
+
+/*
+** The scratch arrays used by process() are thread-local, so any number of
+** threads can expand states at once as long as their children are held in
+** a ChildBlock rather than written to the queue.  The main thread takes
+** part in each parallel step as thread 0; threadId says which one is
+** running.
+*/
+
+static pthread_mutex_t poolLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t poolStart = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t poolDone = PTHREAD_COND_INITIALIZER;
+static void (*poolTask)(void);
+static int poolGeneration = 0;
+static int poolBusy = 0;
+static int poolThreads = 1;	/* number of threads started so far, including main */
+THREADLOCAL int threadId;	/* 0 for the main thread */
+
+/* allocate scratch space for the calling thread */
+static void initScratch(void)
+{
+	rows = growArray(0, &rowsSize, 1, sizeof(Row));
+	compatBits = growArray(0, &compatSize, 1, sizeof(Row));
+	reachBits = growArray(0, &reachSize, 1, sizeof(uint64_t));
+	initRowCache();
+	initStats();
+}
+
+static void * poolThread(void * arg)
+{
+	int generation = 0;
+	threadId = (int) (long) arg;
+	initScratch();
+	for (;;) {
+		void (*task)(void);
+		pthread_mutex_lock(&poolLock);
+		while (poolGeneration == generation) pthread_cond_wait(&poolStart, &poolLock);
+		generation = poolGeneration;
+		task = poolTask;
+		pthread_mutex_unlock(&poolLock);
+		task();
+		pthread_mutex_lock(&poolLock);
+		if (--poolBusy == 0) pthread_cond_signal(&poolDone);
+		pthread_mutex_unlock(&poolLock);
+	}
 	return 0;
 }
 
-static void deepen(int numLevels) {
-	State s = firstUnprocessedState;
-	while (s < firstFreeState) {
-		if (!depthFirst(s, numLevels)) setParentState(s, unused);
-		s = nextState(s);
+/* run task() on all nThreads threads at once and wait for them to finish */
+static void runThreads(void (*task)(void))
+{
+	while (poolThreads < nThreads) {
+		pthread_t t;
+		if (pthread_create(&t, 0, poolThread, (void *) (long) poolThreads) != 0) {
+			fprintf(stderr,"Unable to start thread %d, continuing with %d.\n",
+					poolThreads, poolThreads);
+			nThreads = poolThreads;
+			break;
+		}
+		pthread_detach(t);
+		poolThreads++;
 	}
+	pthread_mutex_lock(&poolLock);
+	poolTask = task;
+	poolBusy = nThreads - 1;
+	poolGeneration++;
+	pthread_cond_broadcast(&poolStart);
+	pthread_mutex_unlock(&poolLock);
+	task();
+	pthread_mutex_lock(&poolLock);
+	while (poolBusy > 0) pthread_cond_wait(&poolDone, &poolLock);
+	pthread_mutex_unlock(&poolLock);
 }
 
-/* ============================ */
-/*  Garbage-collect full queue  */
-/* ============================ */
+/* ============================== */
+/*  Depth first search algorithm  */
+/* ============================== */
 
-static int depth(State s) {
-	int i = 0;
-	while (s != parentState(s)) {
-		s = parentState(s);
-		i++;
+#define unused -1
+
+/*
+** Dead-end cache.  What lies below a state depends only on its last two rows,
+** the same window isDuplicate() compares, so once a window has been found
+** to die out within d levels it need not be searched again to d or more
+** levels in later deepening rounds, and one found to go on for d levels
+** need not be searched again to d or fewer.  Each entry is one 64-bit word,
+** the high 48 bits of the window's hash key and the smallest depth known to
+** be dead and largest known to be live (0 if unknown), so threads can share
+** the table with plain atomic loads and stores; entries are simply replaced
+** on collision.  Sparks make a state's children depend on its depth, so the
+** cache is not used with them, and it is emptied when the rotor shrinks.
+** It is not part of the queue, so it gets its own memory on top of -m, a
+** sixteenth as much, rounded down to a power of two entries.
+*/
+typedef enum { DEEPEN_DEAD, DEEPEN_LIVE, DEEPEN_EXHAUSTED, DEEPEN_NOROOM } DeepenResult;
+uint64_t * deadEnds;
+long deadEndSize;
+long deadEndHits[2];	/* dead and live windows answered from the cache */
+
+static void clearDeadEnds() {
+	free(deadEnds);
+	deadEnds = 0;
+}
+
+/* look up a window: returns DEEPEN_DEAD or DEEPEN_LIVE if known at this depth */
+static int knownDeadEnd(State s, int levels, uint64_t * key) {
+	uint64_t e;
+	int dead, live;
+	*key = hashKey(s);
+	e = __atomic_load_n(&deadEnds[*key & (deadEndSize-1)], __ATOMIC_RELAXED);
+	if ((e >> 16) != (*key >> 16)) return -1;
+	dead = (e >> 8) & 0xff;
+	live = e & 0xff;
+	if (dead != 0 && dead <= levels) {
+		__atomic_fetch_add(&deadEndHits[0], 1, __ATOMIC_RELAXED);
+		return DEEPEN_DEAD;
 	}
-	return i;
+	if (live >= levels) {
+		__atomic_fetch_add(&deadEndHits[1], 1, __ATOMIC_RELAXED);
+		return DEEPEN_LIVE;
+	}
+	return -1;
 }
 
-static void printApprox(long n) {
-	n /= period;
-	if (n <= 9999) printf("%ld",n);
-	else {
-		char unit = 'k';
-		if (n > 999999) {
-			n /= 1000;
-			unit = 'M';
-		}
-		if (n > 99999) printf("%ld%c", n/1000, unit);
-		else printf("%ld.%c%c", n/1000, (char)((n%1000)/100)+'0', unit);
+static void recordDeadEnd(uint64_t key, int levels, int isDead) {
+	uint64_t * p = &deadEnds[key & (deadEndSize-1)];
+	uint64_t e = __atomic_load_n(p, __ATOMIC_RELAXED);
+	int dead = 0, live = 0;
+	if (levels > 0xff) return;
+	if ((e >> 16) == (key >> 16)) {
+		dead = (e >> 8) & 0xff;
+		live = e & 0xff;
 	}
+	if (isDead && (dead == 0 || levels < dead)) dead = levels;
+	if (!isDead && levels > live) live = levels;
+	__atomic_store_n(p, (key >> 16 << 16) | (dead << 8) | live, __ATOMIC_RELAXED);
 }
 
-static void compact() {
-	State oldFirstUnproc = firstUnprocessedState;
-	State oldFirstFree = firstFreeState;
-	State x;
-	State y;
-	int counter = 0;
-	static int lastDepth = 0;
-	int frontierDepth = depth(firstUnprocessedState);
-	if (frontierDepth > lastDepth) lastDepth = frontierDepth;
-	lastDepth++;
+/* set up the cache before a deepening round, if it is to be used */
+static void initDeadEnds() {
+	if (sparkLevel > 0 || deadEnds != 0) return;
+	deadEndSize = 1<<16;
+	while (2 * deadEndSize * sizeof(uint64_t) <= queueFull * sizeof *statespace / 16)
+		deadEndSize *= 2;
+	deadEnds = calloc(deadEndSize, sizeof(uint64_t));
+}
 
-	/* initial output and call to iterative deepening code */
-	printf("Queue full, depth = %d, ", frontierDepth);
-	if (maxDeepen > 0 && rotorWidth > 0 && lastDepth - frontierDepth > maxDeepen) {
+/*
+** Search numLevels below s for a line that goes on that far.  The children
+** of the state being expanded at each level sit on top of statespace above
+** firstFreeState, as the queue's do, with dfsLevel[] marking where each
+** level's children begin; they are tried last one first, and a child whose
+** subtree fails is popped off again.  With a budget (-b), giving up after
+** that many expanded states leaves s neither proven dead nor alive.  In a
+** deepening worker, running out of its part of statespace leaves it
+** unknown too, and nothing is recorded in the dead-end cache.
+*/
+long deepenBudget = 0;	/* most states expanded below one frontier state, 0 for no limit */
+long deepenExhausted = 0;	/* frontier states that ran out of budget in the last deepening */
+THREADLOCAL State * dfsLevel;
+THREADLOCAL long dfsLevelSize;
+
+static DeepenResult depthFirst(State s, int numLevels) {
+	State base = firstFreeState;
+	long expanded = 0;
+	int level = 0;
+	uint64_t key;
+	NICE();
+	if (numLevels == 0) return DEEPEN_LIVE;
+	if (deadEnds) {
+		int known = knownDeadEnd(s, numLevels, &key);
+		if (known >= 0) return known;
+	}
+	if (numLevels > dfsLevelSize) dfsLevel = growArray(dfsLevel, &dfsLevelSize, numLevels, sizeof(State));
+	dfsLevel[0] = base;
+	scratchFull = 0;
+	process(s);
+	for (;;) {
+		if (scratchFull) {
+			firstFreeState = base;
+			return DEEPEN_NOROOM;
+		}
+		if (firstFreeState > dfsLevel[level]) {
+			State child = previousState(firstFreeState);
+			int known = -1;
+			if (level+1 < numLevels && deadEnds) known = knownDeadEnd(child, numLevels-level-1, &key);
+			if (known == DEEPEN_DEAD) {
+				firstFreeState = child;
+				continue;
+			}
+			if (level+1 == numLevels || known == DEEPEN_LIVE) {	/* reached full depth */
+				if (deadEnds)	/* so did every state on the path here */
+					for (; level > 0; level--)
+						recordDeadEnd(hashKey(previousState(dfsLevel[level])), numLevels-level, 0);
+				if (deadEnds) recordDeadEnd(hashKey(s), numLevels, 0);
+				firstFreeState = base;
+				return DEEPEN_LIVE;
+			}
+			if (deepenBudget > 0 && ++expanded > deepenBudget) {
+				firstFreeState = base;
+				return DEEPEN_EXHAUSTED;
+			}
+			NICE();
+			dfsLevel[++level] = firstFreeState;
+			process(child);
+		} else if (level == 0) {
+			if (deadEnds) recordDeadEnd(hashKey(s), numLevels, 1);
+			return DEEPEN_DEAD;
+		} else {	/* pop the failed state */
+			State dead = previousState(dfsLevel[level]);
+			if (deadEnds) recordDeadEnd(hashKey(dead), numLevels-level, 1);
+			firstFreeState = dead;
+			level--;
+		}
+	}
+}
+
+/*
+** With more than one thread, each thread starts with an equal share of the
+** frontier and runs depthFirst() on its states one by one, using its own
+** part of statespace above firstFreeState for the children.  A thread that
+** runs out of states steals the back half of whichever share has the most
+** left.  Thieves pick that share by reading every share's next and end
+** without its lock, so those two are always written atomically, even
+** under the lock.  A state whose subtree does not fit in the thread's part
+** is put aside, and deepen() searches it again afterwards on the main
+** thread, with all of the space above the queue, as a single-threaded
+** search would.
+*/
+
+typedef struct {
+	pthread_mutex_t lock;
+	State next, end;	/* frontier states not yet claimed */
+	State scratch, scratchEnd;	/* this thread's part of statespace */
+	long dead;	/* states found to have no descendants at the full depth */
+	long exhausted;	/* states that ran out of budget first */
+	State * retry;	/* states that ran out of room, for the main thread */
+	long nRetry, retrySize;
+	char pad[64];	/* keep locks of different threads off the same cache line */
+} DeepenShare;
+DeepenShare * deepenShares;
+int deepenLevels;
+
+static int claimDeepening(DeepenShare * d, State * s)
+{
+	int claimed = 0;
+	pthread_mutex_lock(&d->lock);
+	if (d->next < d->end) {
+		*s = d->next;
+		__atomic_store_n(&d->next, nextState(*s), __ATOMIC_RELAXED);
+		claimed = 1;
+	}
+	pthread_mutex_unlock(&d->lock);
+	return claimed;
+}
+
+static int stealDeepening(int thread)
+{
+	DeepenShare * d = &deepenShares[thread];
+	for (;;) {
+		int t, victim = -1;
+		State most = 0;
+		for (t = 0; t < nThreads; t++) {
+			State left = __atomic_load_n(&deepenShares[t].end, __ATOMIC_RELAXED) -
+						 __atomic_load_n(&deepenShares[t].next, __ATOMIC_RELAXED);
+			if (t != thread && left > most) {
+				most = left;
+				victim = t;
+			}
+		}
+		if (victim < 0) return 0;
+		pthread_mutex_lock(&deepenShares[victim].lock);
+		if (deepenShares[victim].next < deepenShares[victim].end) {
+			State v = deepenShares[victim].next;
+			State e = deepenShares[victim].end;
+			State half = ((e - v) / stateSize + 1) / 2;
+			State mid = e - half * stateSize;
+			__atomic_store_n(&deepenShares[victim].end, mid, __ATOMIC_RELAXED);
+			pthread_mutex_unlock(&deepenShares[victim].lock);
+			pthread_mutex_lock(&d->lock);
+			__atomic_store_n(&d->next, mid, __ATOMIC_RELAXED);
+			__atomic_store_n(&d->end, e, __ATOMIC_RELAXED);
+			pthread_mutex_unlock(&d->lock);
+			return 1;
+		}
+		pthread_mutex_unlock(&deepenShares[victim].lock);
+	}
+}
+
+static void deepenShare(void)
+{
+	DeepenShare * d = &deepenShares[threadId];
+	State s;
+	State f = firstFreeState;
+	firstFreeState = d->scratch;
+	scratchEnd = d->scratchEnd;
+	for (;;) {
+		if (!claimDeepening(d, &s)) {
+			if (stealDeepening(threadId)) continue;
+			break;
+		}
+		switch (depthFirst(s, deepenLevels)) {
+			case DEEPEN_DEAD:
+				setParentState(s, unused);
+				d->dead++;
+				break;
+			case DEEPEN_EXHAUSTED:
+				d->exhausted++;
+				break;
+			case DEEPEN_NOROOM:
+				d->retry = growArray(d->retry, &d->retrySize, d->nRetry+1, sizeof(State));
+				d->retry[d->nRetry++] = s;
+				break;
+			case DEEPEN_LIVE:
+				break;
+		}
+	}
+	firstFreeState = f;
+	scratchEnd = 0;
+}
+
+/* deepen one state on the main thread, returning 1 if it is marked unused */
+static int deepenOne(State s, int numLevels) {
+	switch (depthFirst(s, numLevels)) {
+		case DEEPEN_DEAD:
+			setParentState(s, unused);
+			return 1;
+		case DEEPEN_EXHAUSTED:
+			deepenExhausted++;
+			break;
+		case DEEPEN_LIVE:
+		case DEEPEN_NOROOM:	/* not with scratchEnd unset */
+			break;
+	}
+	return 0;
+}
+
+/* returns the number of frontier states marked unused */
+static long deepen(int numLevels) {
+	State s = firstUnprocessedState;
+	State n, share, room;
+	long dead = 0, i;
+	int t;
+	deepenExhausted = 0;
+	initDeadEnds();
+	if (nThreads <= 1) {
+		for (; s < firstFreeState; s = nextState(s)) dead += deepenOne(s, numLevels);
+		return dead;
+	}
+	if (deepenShares == 0) {
+		deepenShares = calloc(nThreads, sizeof *deepenShares);
+		if (deepenShares == 0) {
+			fprintf(stderr,"Unable to allocate memory, aborting.\n");
+			failure();
+		}
+		for (t = 0; t < nThreads; t++) pthread_mutex_init(&deepenShares[t].lock, 0);
+	}
+	n = (firstFreeState - firstUnprocessedState) / stateSize;
+	share = (n + nThreads - 1) / nThreads;
+	room = ((lastState - firstFreeState) / nThreads / stateSize) * stateSize;
+	for (t = 0; t < nThreads; t++) {
+		State end = s + share * stateSize;
+		if (end > firstFreeState) end = firstFreeState;
+		__atomic_store_n(&deepenShares[t].next, s, __ATOMIC_RELAXED);
+		__atomic_store_n(&deepenShares[t].end, end, __ATOMIC_RELAXED);
+		deepenShares[t].scratch = firstFreeState + t * room;
+		deepenShares[t].scratchEnd = firstFreeState + (t + 1) * room;
+		deepenShares[t].dead = 0;
+		deepenShares[t].exhausted = 0;
+		deepenShares[t].nRetry = 0;
+		s = end;
+	}
+	deepenLevels = numLevels;
+	runThreads(deepenShare);
+	for (t = 0; t < nThreads; t++) {
+		dead += deepenShares[t].dead;
+		deepenExhausted += deepenShares[t].exhausted;
+		for (i = 0; i < deepenShares[t].nRetry; i++) dead += deepenOne(deepenShares[t].retry[i], numLevels);
+	}
+	return dead;
+}
+
+/* ============================ */
+/*  Garbage-collect full queue  */
+/* ============================ */
+
+static int depth(State s) {
+	int i = 0;
+	while (s != parentState(s)) {
+		s = parentState(s);
+		i++;
+	}
+	return i;
+}
+
+/* print a span of statespace words in the units of an unpacked queue */
+static void printApprox(long n) {
+	n = n / stateSize * (period + 1) / period;
+	if (n <= 9999) printf("%ld",n);
+	else {
+		char unit = 'k';
+		if (n > 999999) {
+			n /= 1000;
+			unit = 'M';
+		}
+		if (n > 99999) printf("%ld%c", n/1000, unit);
+		else printf("%ld.%c%c", n/1000, (char)((n%1000)/100)+'0', unit);
+	}
+}
+
+int lastDepth = 0;	/* depth reached by the last round of deepening */
+long compactions = 0;
+FILE * statsOut = 0;	/* where -J sends the counters */
+int statsInterval = 0;	/* seconds between reports, 0 for none */
+
+static void compact() {
+	State oldFirstUnproc = firstUnprocessedState;
+	State oldFirstFree = firstFreeState;
+	State x;
+	State y;
+	long counter = 0;
+	int frontierDepth = depth(firstUnprocessedState);
+	if (frontierDepth > lastDepth) lastDepth = frontierDepth;
+	lastDepth++;
+
+	/* initial output and call to iterative deepening code */
+	printf("Queue full, depth = %d, ", frontierDepth);
+	if (maxDeepen > 0 && rotorWidth > 0 && lastDepth - frontierDepth > maxDeepen) {
 		rotorWidth--;
 		rightStatorWidth++;
 		if (leftStatorWidth > 0 && rotorWidth > 0) {
@@ -1194,6 +2815,7 @@ static void compact() {
 			rotorWidth--;
 		}
 		printf("shrinking rotor, ");
+		clearDeadEnds();
 		lastDepth = frontierDepth + 1;
 	}
 	printf("deepening %d, ",lastDepth - frontierDepth);
@@ -1202,8 +2824,13 @@ static void compact() {
 	printApprox(oldFirstFree - firstState);
 	fflush(stdout);
 	hashing = 0;
-	deepen(lastDepth - frontierDepth);	/* do this before outputting arrow */
+	counter = deepen(lastDepth - frontierDepth);	/* do this before outputting arrow */
 	hashing = 1;
+	if (deepenExhausted > 0) {
+		printf(", ");
+		printApprox(deepenExhausted * stateSize);
+		printf(" over budget");
+	}
 	printf(" -> ");						/* so user can tell what stage of compaction */
 	fflush(stdout);
 
@@ -1215,8 +2842,10 @@ static void compact() {
 	y = previousState(firstFreeState);
 	clearHash();
 	while (parentState(y) == unused) y = previousState(y);
+	resetSpill(y);
 	do {
 		NICE();
+		if (spillFd >= 0 && y < spillNext) streamBack(x, y);
 		while (parentState(y) != x) {	/* search backwards for y's parent, marking other nodes */
 			if (parentState(x) == x) {	/* sanity check */
 				fprintf(stderr,"Unable to find parent of y!\n");
@@ -1242,13 +2871,13 @@ static void compact() {
 		x = firstState;
 		while (parentState(x) != unused) x = nextState(x);
 		y = x;
+		resetSpill(y);
 		while (y < firstFreeState) {
 			NICE();
+			if (spillFd >= 0 && y >= spillNext) streamPass(x, y);
 			if (parentState(y) != unused) {
-				int phase;
-				setParentState(x, parentState(y));
-				for (phase = 0; phase < period; phase++)
-					setRowOfState(x, phase, rowOfState(y, phase));
+				int i;
+				for (i = 0; i < stateSize; i++) statespace[x + i] = statespace[y + i];
 				x = nextState(x);
 			}
 			if (y == firstUnprocessedState) firstUnprocessedState = x;
@@ -1265,8 +2894,10 @@ static void compact() {
 
 		x = y = firstState;
 		x = nextState(x);
+		resetSpill(x);
 		while (x < firstFreeState) {
 			NICE();
+			if (spillFd >= 0 && x >= spillNext) streamPass(x, x);
 			if (parentState(x) == y) setParentState(x, parentState(previousState(x)));
 			else {
 				y = parentState(x);
@@ -1277,26 +2908,504 @@ static void compact() {
 		}
 	}
 
+	releaseStateSpace();
+	resetSpill(firstUnprocessedState);
 	printApprox(firstFreeState - firstUnprocessedState);
 	printf("/");
 	printApprox(firstFreeState - firstState);
+	if (verbose) {
+		putchar('\n');
+		printHashStats();
+		hashBenchmark();
+		if (deadEnds) printf("Dead-end cache: %ld dead and %ld live windows found in %ld entries\n",
+							 deadEndHits[0], deadEndHits[1], deadEndSize);
+	}
 	printstatus();
 	printf("\n");
 	fflush(stdout);
+	compactions++;
+	if (statsOut) reportStats("compact");
+	flushResults();
+	writeCheckpoint();
+}
+
+/* ======================== */
+/*  Reporting the counters  */
+/* ======================== */
+
+/*
+** With -J file (or - for standard error), one JSON object per line is
+** appended to the file after each compaction, every -i seconds, and when
+** ofind exits.  SIGUSR1 asks for a line at any time, on standard error if
+** there is no -J.  Lines are written from the breadth first loop, between
+** parallel steps, so the other threads are idle while their counts are
+** summed.
+*/
+
+static volatile sig_atomic_t statsRequested = 0;
+struct timeval statsStart;
+
+static void requestStats(int sig) {
+	statsRequested = sig;
+}
+
+#ifndef NOSTATS
+static const char * stageNames[NSTAGES] = {
+	"listRows", "testCompatible", "pruneRows", "testReachable", "processGroup", "terminal", "terminate"
+};
+#endif
+
+static void reportStats(char * event) {
+	FILE * f = statsOut ? statsOut : stderr;
+#ifndef NOSTATS
+	int atExit = !strcmp(event, "exit");
+	Stats sum;
+	struct timeval now;
+	double seconds;
+	long i;
+	int j;
+	memset(&sum, 0, sizeof sum);
+	for (i = 0; i < nAllStats; i++) {
+		for (j = 0; j < NSTAGES; j++) {
+			sum.calls[j] += allStats[i]->calls[j];
+			sum.ticks[j] += allStats[i]->ticks[j];
+		}
+		for (j = 0; j < MAXPERIOD; j++) sum.rowsListed[j] += allStats[i]->rowsListed[j];
+		sum.states += allStats[i]->states;
+		sum.rowCacheHits += allStats[i]->rowCacheHits;
+		sum.rowCacheMisses += allStats[i]->rowCacheMisses;
+	}
+	gettimeofday(&now, 0);
+	seconds = (now.tv_sec - statsStart.tv_sec) + (now.tv_usec - statsStart.tv_usec) / 1e6;
+	fprintf(f, "{\"event\":\"%s\",\"seconds\":%.3f", event, seconds);
+	/* exit() may come in the middle of deepening, which marks dead states' parents unused */
+	if (!atExit && statespace != 0 && firstUnprocessedState < firstFreeState)
+		fprintf(f, ",\"depth\":%d", depth(firstUnprocessedState));
+	fprintf(f, ",\"compactions\":%ld,\"queued\":%ld,\"frontier\":%ld",
+			compactions, (long) (firstFreeState / (stateSize ? stateSize : 1)),
+			(long) ((firstFreeState - firstUnprocessedState) / (stateSize ? stateSize : 1)));
+	fprintf(f, ",\"states\":%" PRIu64 ",\"statesPerSecond\":%.0f", sum.states,
+			seconds > 0 ? sum.states / seconds : 0.0);
+	fprintf(f, ",\"hashDuplicates\":%ld,\"hashNew\":%ld,\"duplicateRate\":%.4f",
+			hashHits, hashMisses, hashHits + hashMisses > 0 ? hashHits / (double) (hashHits + hashMisses) : 0.0);
+	fprintf(f, ",\"rowsPerState\":[");
+	for (j = 0; j < period; j++)
+		fprintf(f, "%s%.2f", j ? "," : "", sum.states ? sum.rowsListed[j] / (double) sum.states : 0.0);
+	fprintf(f, "],\"rowCacheHits\":%" PRIu64 ",\"rowCacheMisses\":%" PRIu64 ",\"rowCacheHitRate\":%.4f",
+			sum.rowCacheHits, sum.rowCacheMisses, sum.rowCacheHits + sum.rowCacheMisses > 0 ?
+			sum.rowCacheHits / (double) (sum.rowCacheHits + sum.rowCacheMisses) : 0.0);
+	fprintf(f, ",\"stages\":{");
+	for (j = 0; j < NSTAGES; j++)
+		fprintf(f, "%s\"%s\":{\"calls\":%" PRIu64 ",\"ticks\":%" PRIu64 "}",
+				j ? "," : "", stageNames[j], sum.calls[j], sum.ticks[j]);
+#if defined(__x86_64__) || defined(__i386__)
+	fprintf(f, "},\"ticks\":\"cycles\"}\n");
+#else
+	fprintf(f, "},\"ticks\":\"ns\"}\n");
+#endif
+#else
+	fprintf(f, "{\"event\":\"%s\",\"compactions\":%ld}\n", event, compactions);
+#endif
+	fflush(f);
+	statsRequested = 0;
+}
+
+static void reportStatsAtExit(void) {
+	reportStats("exit");
+}
+
+/* called as the search starts */
+static void startStats(void) {
+	gettimeofday(&statsStart, 0);
+	signal(SIGUSR1, requestStats);
+	if (statsOut) atexit(reportStatsAtExit);
+	if (statsInterval > 0) {
+		struct itimerval t;
+		t.it_interval.tv_sec = t.it_value.tv_sec = statsInterval;
+		t.it_interval.tv_usec = t.it_value.tv_usec = 0;
+		signal(SIGALRM, requestStats);
+		setitimer(ITIMER_REAL, &t, 0);
+	}
+}
+
+/* ============================================ */
+/*  Checkpoints of the queue for resuming later  */
+/* ============================================ */
+
+/*
+** A checkpoint is a header giving the search parameters and queue pointers,
+** padded to CHECKPOINT_HEADER bytes so that the queue contents that follow
+** can be mapped straight back into statespace.  It is written after each
+** compaction to a temporary file that is then renamed over the old one.
+*/
+
+#define CHECKPOINT_MAGIC 0x316b6364696e666fLL	/* "ofindck1" */
+#define CHECKPOINT_HEADER 65536	/* multiple of any page size we map with */
+char * checkpointFile = 0;
+char * resumeFile = 0;
+
+typedef struct {
+	int64_t magic, rowBits;
+	int64_t rule, period, symmetry, allowRowSym;
+	int64_t rotorWidth, leftStatorWidth, rightStatorWidth;
+	int64_t maxDeepen, sparkLevel, zeroLotLine, lastDepth;
+	int64_t queueFull, firstUnprocessedState, firstFreeState;
+	int64_t packedWidth;	/* zero in checkpoints from before -z */
+} CheckpointHeader;
+
+/* write a checkpoint of the queue words[0..free), expanded up to unprocessed */
+static int writeQueueFile(char * name, Row * words, State unprocessed, State free) {
+	static char header[CHECKPOINT_HEADER];
+	CheckpointHeader * h = (CheckpointHeader *) header;
+	char tmp[1100];
+	FILE * f;
+	h->magic = CHECKPOINT_MAGIC;
+	h->rowBits = ROWBITS;
+	h->rule = rule;
+	h->period = period;
+	h->symmetry = symmetry;
+	h->allowRowSym = allow_row_sym;
+	h->rotorWidth = rotorWidth;
+	h->leftStatorWidth = leftStatorWidth;
+	h->rightStatorWidth = rightStatorWidth;
+	h->maxDeepen = maxDeepen;
+	h->sparkLevel = sparkLevel;
+	h->zeroLotLine = zeroLotLine;
+	h->lastDepth = lastDepth;
+	h->queueFull = queueFull;
+	h->firstUnprocessedState = unprocessed;
+	h->firstFreeState = free;
+	h->packedWidth = packedWidth;
+	snprintf(tmp, sizeof tmp, "%s.tmp", name);
+	f = fopen(tmp, "wb");
+	if (f == 0 || fwrite(header, 1, CHECKPOINT_HEADER, f) != CHECKPOINT_HEADER ||
+		fwrite(words, sizeof *words, free, f) != (size_t) free ||
+		fclose(f) != 0 || rename(tmp, name) != 0) {
+		if (f != 0) remove(tmp);
+		return 0;
+	}
+	return 1;
+}
+
+static void writeCheckpoint() {
+	if (checkpointFile == 0) return;
+	if (!writeQueueFile(checkpointFile, statespace, firstUnprocessedState, firstFreeState)) {
+		fprintf(stderr,"Unable to write checkpoint %s, continuing without it.\n", checkpointFile);
+		checkpointFile = 0;
+	}
+}
+
+/* read() that retries until done, since large reads may return early */
+static int readFully(int fd, void * buf, size_t bytes) {
+	char * p = buf;
+	while (bytes > 0) {
+		ssize_t n = read(fd, p, bytes);
+		if (n <= 0) return 0;
+		p += n;
+		bytes -= n;
+	}
+	return 1;
+}
+
+/* open a checkpoint and read its header, exiting if it is not one this build can use */
+static int openCheckpoint(char * name, CheckpointHeader * h) {
+	int fd = open(name, O_RDONLY);
+	if (fd < 0 || !readFully(fd, h, sizeof *h) || h->magic != CHECKPOINT_MAGIC) {
+		fprintf(stderr,"%s is not an ofind checkpoint.\n", name);
+		exit(1);
+	}
+	if (h->rowBits != ROWBITS) {
+		fprintf(stderr,"%s was written by a %d-bit build of ofind.\n", name, (int) h->rowBits);
+		exit(1);
+	}
+	return fd;
+}
+
+/* read parameters and queue from resumeFile in place of readParams() */
+static void readCheckpoint() {
+	CheckpointHeader h;
+	State x;
+	size_t bytes;
+	int fd = openCheckpoint(resumeFile, &h);
+	rule = h.rule;
+	period = h.period;
+	symmetry = h.symmetry;
+	allow_row_sym = h.allowRowSym;
+	rotorWidth = h.rotorWidth;
+	leftStatorWidth = h.leftStatorWidth;
+	rightStatorWidth = h.rightStatorWidth;
+	maxDeepen = h.maxDeepen;
+	sparkLevel = h.sparkLevel;
+	zeroLotLine = h.zeroLotLine;
+	lastDepth = h.lastDepth;
+	packQueue = h.packedWidth != 0;
+	setStateSize();
+	if (packedWidth != h.packedWidth) {
+		fprintf(stderr,"%s has rows packed in an unknown layout.\n", resumeFile);
+		exit(1);
+	}
+	if (memoryBudget <= 0) memoryBudget = h.queueFull * sizeof *statespace;
+	reserveStateSpace();
+	if (h.firstFreeState > queueFull) {
+		fprintf(stderr,"Queue in %s needs more memory than given with -m.\n", resumeFile);
+		exit(1);
+	}
+	firstUnprocessedState = h.firstUnprocessedState;
+	firstFreeState = h.firstFreeState;
+
+	/* map the saved queue copy-on-write over the start of statespace, */
+	/* or copy it into the queue file so that it can be written out again */
+	bytes = firstFreeState * sizeof *statespace;
+	if ((spillFd >= 0 || mmap(statespace, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED,
+							  fd, CHECKPOINT_HEADER) == MAP_FAILED) &&
+		(lseek(fd, CHECKPOINT_HEADER, SEEK_SET) < 0 || !readFully(fd, statespace, bytes))) {
+		fprintf(stderr,"Unable to read queue from %s.\n", resumeFile);
+		exit(1);
+	}
+	close(fd);
+
+	/* rebuild the duplicate table the way compact() leaves it */
+	clearHash();
+	for (x = nextState(firstState); x < firstFreeState; x = nextState(x)) (void) hash(x);
+	printf("Resuming %s at depth %d, ", resumeFile, depth(previousState(firstFreeState)));
+	printApprox(firstFreeState - firstUnprocessedState);
+	printf("/");
+	printApprox(firstFreeState - firstState);
+	printf("\n");
+}
+
+/* ========================================= */
+/*  Work units for searching on many machines  */
+/* ========================================= */
+
+/*
+** With -W dir -U n, once UNITSTATES unexpanded states per unit are queued,
+** the frontier is cut into n slices.  Each slice is written to dir as a
+** checkpoint holding just the slice and its ancestors.  process() and
+** terminal() only look two rows back, but success() prints the whole line
+** from the initial rows.  Workers, each run as ofind -W dir, claim units by
+** renaming them, and resume each one in a child process with its output
+** in unit-N.out.  The file is then renamed to unit-N.found or unit-N.dead,
+** according to whether the child found a pattern or ran out of states.
+*/
+
+#define UNITSTATES 64
+#define UNIT_UNFINISHED 2	/* exit status of a work unit stopped by failure() */
+#define UNIT_DEAD 3	/* exit status of a work unit whose states all died out */
+char * unitDir = 0;
+int nUnits = 0;
+
+static void unitName(char * name, size_t size, int unit) {
+	snprintf(name, size, "%s/unit-%05d", unitDir, unit);
+}
+
+static int compareStates(const void * a, const void * b) {
+	State x = *(const State *) a, y = *(const State *) b;
+	return (x > y) - (x < y);
+}
+
+/*
+** Write the states in [first, end) and their ancestors as a checkpoint.
+** newIndex is indexed by state number and holds -1 except for states
+** marked as ancestors of this slice, and is left that way again.
+*/
+static int writeUnit(char * name, State first, State end, State * newIndex,
+					 State ** marked, long * markedSize) {
+	long nMarked = 0, i;
+	State s, n = 0;
+	Row * words;
+	int ok;
+	*marked = growArray(*marked, markedSize, 1, sizeof(State));
+	(*marked)[nMarked++] = firstState;	/* the root is its own parent */
+	newIndex[firstState / stateSize] = 0;
+	for (s = first; s < end; s = nextState(s)) {
+		State t = parentState(s);
+		while (newIndex[t / stateSize] < 0) {
+			*marked = growArray(*marked, markedSize, nMarked+1, sizeof(State));
+			(*marked)[nMarked++] = t;
+			newIndex[t / stateSize] = 0;
+			t = parentState(t);
+		}
+	}
+	qsort(*marked, nMarked, sizeof(State), compareStates);
+	for (i = 0; i < nMarked; i++, n += stateSize) newIndex[(*marked)[i] / stateSize] = n;
+	words = malloc((n + end - first) * sizeof *words);
+	if (words == 0) {
+		fprintf(stderr,"Unable to allocate memory, aborting.\n");
+		failure();
+	}
+	for (i = 0; i < nMarked; i++) {
+		State t = (*marked)[i];
+		memcpy(words + i * stateSize, statespace + t, stateSize * sizeof *words);
+		words[i * stateSize] = newIndex[parentState(t) / stateSize];
+	}
+	for (s = first; s < end; s = nextState(s)) {
+		memcpy(words + n + (s - first), statespace + s, stateSize * sizeof *words);
+		words[n + (s - first)] = newIndex[parentState(s) / stateSize];
+	}
+	ok = writeQueueFile(name, words, n, n + end - first);
+	free(words);
+	for (i = 0; i < nMarked; i++) newIndex[(*marked)[i] / stateSize] = -1;
+	return ok;
+}
+
+static void writeUnits(void) {
+	long states = (firstFreeState - firstUnprocessedState) / stateSize;
+	long perUnit = (states + nUnits - 1) / nUnits;
+	long processed = firstUnprocessedState / stateSize, i;
+	State * newIndex = malloc(processed * sizeof(State));
+	State * marked = 0;
+	long markedSize = 0;
+	State s = firstUnprocessedState;
+	int unit;
+	if (newIndex == 0) {
+		fprintf(stderr,"Unable to allocate memory, aborting.\n");
+		failure();
+	}
+	for (i = 0; i < processed; i++) newIndex[i] = -1;
+	for (unit = 0; s < firstFreeState; unit++) {
+		char name[1100];
+		State end = s + perUnit * stateSize;
+		if (end > firstFreeState) end = firstFreeState;
+		unitName(name, sizeof name, unit);
+		if (!writeUnit(name, s, end, newIndex, &marked, &markedSize)) {
+			fprintf(stderr,"Unable to write work unit %s, aborting.\n", name);
+			exit(1);
+		}
+		s = end;
+	}
+	printf("Queue split at depth %d into %d work units in %s\n",
+		   depth(previousState(firstFreeState)), unit, unitDir);
+	exit(0);
 }
 
 /* ================================ */
 /*  Breadth first search algorithm  */
 /* ================================ */
 
+/*
+** With more than one thread, the frontier is cut into blocks of BLOCKSTATES
+** states that the threads claim one at a time.  Their children are then
+** merged into the queue block by block, so the queue order (and therefore the
+** search itself) is the same as for a single thread, except that the check
+** for a full queue is only made between batches.  Batches are kept small
+** enough that their children are likely to fit below queueFull.
+*/
+
+#define BLOCKSTATES 32
+#define BLOCKSPERTHREAD 16
+ChildBlock * childBlocks;
+int nChildBlocks;
+int nextChildBlock;
+long expandedStates = 0;	/* totals for the last batch */
+long expandedChildren = 0;
+
+static void expandBlocks(void)
+{
+	for (;;) {
+		int b = __sync_fetch_and_add(&nextChildBlock, 1);
+		if (b >= nChildBlocks) break;
+		childBlock = &childBlocks[b];
+		childBlock->nChildren = childBlock->nFound = 0;
+		processBlock(childBlock->first, childBlock->last);
+	}
+	childBlock = 0;
+}
+
+static void mergeBlock(ChildBlock * b)
+{
+	long i;
+	int phase;
+	for (i = 0; i < b->nFound; i++)
+		if (terminal(b->found[i])) success(b->found[i]);	/* recompute row_symmetry */
+	for (i = 0; i < b->nChildren; i++) {
+		Row * c = b->children + i*(period+1);
+		State s = firstFreeState;
+		firstFreeState = nextState(s);
+		setParentState(s, c[0]);
+		for (phase = 0; phase < period; phase++) setRowOfState(s, phase, c[1+phase]);
+		if (hashing && hash(s)) firstFreeState = s;
+	}
+	expandedChildren += b->nChildren;
+}
+
+static void parallelStep(void)
+{
+	int b, blockStates;
+	State s = firstUnprocessedState;
+	long batch = nThreads * BLOCKSPERTHREAD * BLOCKSTATES;
+	if (expandedStates > 0) {
+		long room = (queueFull - firstFreeState) / stateSize;
+		long perState = (expandedChildren + expandedStates - 1) / expandedStates;
+		if (perState > 0 && room / perState < batch) batch = room / perState;
+		if (batch < nThreads) batch = nThreads;
+	}
+	blockStates = (batch + nThreads * BLOCKSPERTHREAD - 1) / (nThreads * BLOCKSPERTHREAD);
+	expandedStates = expandedChildren = 0;
+	if (childBlocks == 0) {
+		childBlocks = calloc(nThreads * BLOCKSPERTHREAD, sizeof *childBlocks);
+		if (childBlocks == 0) {
+			fprintf(stderr,"Unable to allocate memory, aborting.\n");
+			failure();
+		}
+	}
+	for (nChildBlocks = 0; nChildBlocks < nThreads * BLOCKSPERTHREAD && s < firstFreeState && batch > 0;
+		 nChildBlocks++) {
+		int n;
+		childBlocks[nChildBlocks].first = s;
+		for (n = 0; n < blockStates && s < firstFreeState && batch > 0; n++, batch--) s = nextState(s);
+		childBlocks[nChildBlocks].last = s;
+		expandedStates += n;
+	}
+	firstUnprocessedState = s;
+	nextChildBlock = 0;
+	runThreads(expandBlocks);
+	for (b = 0; b < nChildBlocks; b++) {
+		ChildBlock * c = &childBlocks[b];
+		if (firstFreeState + (State) c->nChildren * stateSize >= lastState && firstFreeState >= queueFull) {
+			/* more children than the estimate left room for: expand the rest again after compacting */
+			firstUnprocessedState = c->first;
+			for (; b < nChildBlocks; b++)
+				expandedStates -= (childBlocks[b].last - childBlocks[b].first) / stateSize;
+			break;
+		}
+		mergeBlock(c);
+	}
+}
+
+/* one state at a time, so that the queue is compacted at the same points with any TERMBATCH */
 static void breadthFirst(void)
 {
+	unsigned char isTerminal[TERMBATCH];
+	State batch = 0, batchEnd = 0;	/* states tested for terminal() ahead, in isTerminal[] */
+	STAT_TIMER(t);
 	while (firstUnprocessedState != firstFreeState) {
 		State s;
-		if (firstFreeState >= queueFull) compact();
+		int n;
+		if (firstFreeState >= queueFull) {
+			compact();
+			batchEnd = 0;	/* the states have moved */
+		}
+		if (statsRequested) reportStats(statsRequested == SIGUSR1 ? "signal" : "timer");
+		if (spillFd >= 0 && firstUnprocessedState >= spillNext) streamQueue();
+		if (nUnits > 0 && firstFreeState - firstUnprocessedState >= (State) nUnits * UNITSTATES * stateSize)
+			writeUnits();
+		if (nThreads > 1) {
+			parallelStep();
+			continue;
+		}
 		s = firstUnprocessedState;
+		if (s < batch || s >= batchEnd) {
+			batch = batchEnd = s;
+			for (n = 0; n < TERMBATCH && batchEnd != firstFreeState; n++) batchEnd = nextState(batchEnd);
+			STAT_START_ALWAYS(t);
+			terminalBlock(batch, n, isTerminal);
+			STAT_STOP_ALWAYS(STAGE_TERMINAL, t, n);
+		}
 		firstUnprocessedState = nextState(s);
-		process(s);
+		STAT_ADD(states, 1);
+		STAT_SAMPLE();
+		expand(s, isTerminal[(s - batch) / stateSize]);
 	}
 }
 
@@ -1320,9 +3429,26 @@ static char * readString(char * prompt) {
 	return s;
 }
 
+/* parse a rule in the form Bxxx/Syyy, returning -1 if malformed */
+static int parseRule(char * s) {
+	int shift = 0;
+	int r = 0;
+	if (*s == '\0') return 010014;	/* internal repn of life the universe & everything */
+	for (;;) {
+		if (*s >= '0' && *s <= '9') r |= 1 << (shift + *s - '0');
+		else switch(*s) {
+			case 'b': case 'B': shift = 9; break;
+			case 's': case 'S': shift = 0; break;
+			case '/': shift = 9-shift; break;
+			case '\0': return r;
+			default: return -1;
+		}
+		s++;
+	}
+}
+
 static void readRule() {
 	char * s = readString("Rule: ");
-	int shift = 0;
 	rule = 0;
 	if (*s == '^') readRule();
 	else if (*s == '?') {
@@ -1332,46 +3458,44 @@ static void readRule() {
 		printf("that cause a cell to die.  For instance, for Conway's Life\n");
 		printf("(the default), the rule would be written B3/S23.\n");
 		readRule();
-	} else if (*s == '\0') rule = 010014;	/* internal repn of life the universe & everything */
-	else for (;;) {
-		if (*s >= '0' && *s <= '9') rule |= 1 << (shift + *s - '0');
-		else switch(*s) {
-			case 'b': case 'B': shift = 9; break;
-			case 's': case 'S': shift = 0; break;
-			case '/': shift = 9-shift; break;
-			case '\0': return;
-			default:
-				fprintf(stderr,"Unrecognized rule format\n");
-				readRule();
-				return;
+	} else if ((rule = parseRule(s)) < 0) {
+		fprintf(stderr,"Unrecognized rule format\n");
+		readRule();
+	}
+}
+
+/* parse a row of '.' and 'o' cells: returns 1 if ok, 0 for a bad character, -1 if too long */
+static int parseRow(char * s, Row * row) {
+	int bit = 0;
+	*row = 0;
+	for (;;) {
+		switch(*s) {
+			case '.': break;
+			case 'o': case 'O': *row |= ((Row) 1)<<bit; break;
+			case '\0': return 1;
+			default: return 0;
 		}
-		s++;
+		bit++; s++;
+		if (bit > totalWidth) return -1;
 	}
 }
 
 static Row readRow(int phase) {
 	char * s;
-	int bit = 0;
-	Row row = 0;
+	Row row;
 	fprintf(stderr,"Phase ");
 	if (period > 9 && phase <= 9) fprintf(stderr," ");
 	fprintf(stderr,"%d",phase);
 	s = readString(": ");
-	for (;;) {
-		switch(*s) {
-			case '.': break;
-			case 'o': case 'O': row |= 1<<bit; break;
-			case '\0': return row;
-			default:
-				printf("unexpected character in row input!\n");
-				return readRow(phase);
-		}
-		bit++; s++;
-		if (bit > totalWidth) {
+	switch (parseRow(s, &row)) {
+		case 0:
+			printf("unexpected character in row input!\n");
+			return readRow(phase);
+		case -1:
 			fprintf(stderr,"Too many cells in row!\n");
 			return readRow(phase);
-		}
 	}
+	return row;
 }
 
 static int nonInt(char * s) {
@@ -1496,8 +3620,8 @@ static void readParams() {
 			if (*s == '^') { readParamState = rp_complete; continue; }
 			if (*s == '?') { helpWidth(); continue; }
 			rotorWidth = atoi(s);
-			if (nonInt(s) || rotorWidth <= 0 || rotorWidth > 32) {
-				fprintf(stderr,"Width must be an integer in the range 1..32\n");
+			if (nonInt(s) || rotorWidth <= 0 || rotorWidth > MAXWIDTH) {
+				fprintf(stderr,"Width must be an integer in the range 1..%d\n",MAXWIDTH);
 				continue;
 			}
 			if (period == 1) readParamState = rp_zll;
@@ -1510,8 +3634,8 @@ static void readParams() {
 				if (*s == '^') { readParamState = rp_rotor; continue; }
 				if (*s == '?') { helpWidth(); continue; }
 				leftStatorWidth = atoi(s);
-				if (nonInt(s) || leftStatorWidth < 0 || leftStatorWidth+rotorWidth > 32) {
-					fprintf(stderr,"Width must be an integer in the range 0..32\n");
+				if (nonInt(s) || leftStatorWidth < 0 || leftStatorWidth+rotorWidth > MAXWIDTH) {
+					fprintf(stderr,"Width must be an integer in the range 0..%d\n",MAXWIDTH-rotorWidth);
 					continue;
 				}
 			} else leftStatorWidth = 0;
@@ -1527,8 +3651,9 @@ static void readParams() {
 			}
 			if (*s == '?') { helpWidth(); continue; }
 			rightStatorWidth = atoi(s);
-			if (nonInt(s) || rightStatorWidth < 0 || totalWidth > 32) {
-				fprintf(stderr,"Width must be an integer in the range 0..32\n");
+			if (nonInt(s) || rightStatorWidth < 0 || totalWidth > MAXWIDTH) {
+				fprintf(stderr,"Width must be an integer in the range 0..%d\n",
+						MAXWIDTH-rotorWidth-leftStatorWidth);
 				continue;
 			}
 			readParamState = rp_zll;
@@ -1633,25 +3758,651 @@ static void readParams() {
 
 }
 
+/* =========================== */
+/*  Cache of rule tables       */
+/* =========================== */
+
+/*
+** The tables built by makeExtTab() and initTermTabs() depend only on the
+** rule, but take a noticeable fraction of a second to build, mostly for
+** nxTerm.  With -T dir they are saved to dir/ofind<ROWBITS>-<rule>.tab the first
+** time a rule is used, and later runs read them back instead.  As with
+** checkpoints, the file is written under a temporary name and renamed,
+** so concurrent runs never see a partial file.
+*/
+
+#define TABLES_MAGIC 0x316261746e69666fLL	/* "ofindtb1" */
+
+char * tableDir = 0;
+int tablesRule = -1;	/* rule the lookup tables were last built for */
+
+static struct { void * table; size_t size; } ruleTables[] = {
+	{ extTab, sizeof extTab },
+	{ revTerm, sizeof revTerm },
+	{ nxTerm, sizeof nxTerm },
+	{ tcompat, sizeof tcompat },
+	{ tcompat3, sizeof tcompat3 },
+	{ stabtab, sizeof stabtab },
+	{ count, sizeof count },
+	{ bitCount, sizeof bitCount },
+};
+#define NRULETABLES (sizeof ruleTables / sizeof ruleTables[0])
+
+static void tableFileName(char * name, size_t size) {
+	snprintf(name, size, "%s/ofind%d-%o.tab", tableDir, ROWBITS, rule);
+}
+
+/* read the tables for the current rule, returning 0 if not cached */
+static int readTables() {
+	int64_t h[3];
+	char name[1100];
+	unsigned int i;
+	int fd, ok;
+	tableFileName(name, sizeof name);
+	fd = open(name, O_RDONLY);
+	if (fd < 0) return 0;
+	ok = readFully(fd, h, sizeof h) && h[0] == TABLES_MAGIC && h[1] == rule && h[2] == ROWBITS;
+	for (i = 0; ok && i < NRULETABLES; i++)
+		ok = readFully(fd, ruleTables[i].table, ruleTables[i].size);
+	close(fd);
+	return ok;
+}
+
+static void writeTables() {
+	int64_t h[3];
+	char name[1100], tmp[1200];
+	unsigned int i;
+	int ok;
+	FILE * f;
+	h[0] = TABLES_MAGIC;
+	h[1] = rule;
+	h[2] = ROWBITS;	/* count[] is made of Rows */
+	tableFileName(name, sizeof name);
+	snprintf(tmp, sizeof tmp, "%s.%ld", name, (long) getpid());
+	f = fopen(tmp, "wb");
+	ok = f != 0 && fwrite(h, sizeof h, 1, f) == 1;
+	for (i = 0; ok && i < NRULETABLES; i++)
+		ok = fwrite(ruleTables[i].table, ruleTables[i].size, 1, f) == 1;
+	if (f != 0 && fclose(f) != 0) ok = 0;
+	if (!ok || rename(tmp, name) != 0) {
+		fprintf(stderr,"Unable to write table cache %s\n", name);
+		if (f != 0) remove(tmp);
+	}
+}
+
+/* build the rule tables unless they are already built for this rule */
+static void makeTables() {
+	if (rule != tablesRule) {
+		if (tableDir == 0 || !readTables()) {
+			makeExtTab();
+			initTermTabs();
+			if (tableDir != 0) writeTables();
+		}
+		initSplitTerm();
+		initTermMasks();
+		tablesRule = rule;
+	}
+	initTermState();
+}
+
+/* ==================================== */
+/*  Command line flags and batch jobs   */
+/* ==================================== */
+
+/*
+** Each prompt of readParams() has a matching flag, so a search can be given
+** entirely on the command line or as one line of a job file run with -j.
+** Every job runs in a forked child, so the exit() in success() and failure()
+** ends only that job, and the rule tables the parent builds before forking
+** are shared by all the jobs that use the same rule.
+*/
+
+int searchFlags = 0;	/* were any search parameters given as flags? */
+int nFlagRows = 0;
+char * flagRows[2];
+char * jobFile = 0;
+char * benchName = 0;
+
+static void usage() {
+	fprintf(stderr,"Usage: ofind [options]\n");
+	fprintf(stderr,"Search parameters are read from prompts on standard input unless\n");
+	fprintf(stderr,"given by these flags (defaults as in the prompts where they have one):\n");
+	fprintf(stderr,"  -rule Bxxx/Syyy      rule (B3/S23)\n");
+	fprintf(stderr,"  -p n                 period\n");
+	fprintf(stderr,"  -sym even|odd|none   symmetry\n");
+	fprintf(stderr,"  -complete y|n        allow symmetric completion of patterns (y)\n");
+	fprintf(stderr,"  -w n                 rotor width, or still life width for period 1\n");
+	fprintf(stderr,"  -left n, -right n    stator widths for no symmetry (0)\n");
+	fprintf(stderr,"  -stator n            stator width for even or odd symmetry (0)\n");
+	fprintf(stderr,"  -zll y|n             keep final stator rows within the width (n)\n");
+	fprintf(stderr,"  -deepen n            maximum deepening amount, 0 for no limit (0)\n");
+	fprintf(stderr,"  -row r,r,...         an initially specified row, one field per phase;\n");
+	fprintf(stderr,"                       give twice for two rows, top row first\n");
+	fprintf(stderr,"  -sparks n            treat the first n of two initial rows as sparks\n");
+	fprintf(stderr,"Other options:\n");
+	fprintf(stderr,"  -t n                 number of threads\n");
+	fprintf(stderr,"  -m size              queue memory (e.g. 512M or 4G); the hash table\n");
+	fprintf(stderr,"                       can take up to twice this much more, and the\n");
+	fprintf(stderr,"                       dead-end cache a sixteenth more\n");
+	fprintf(stderr,"  -s dir               keep the queue in a file in dir so it can exceed memory\n");
+	fprintf(stderr,"  -M size              memory to keep the queue file in (a quarter of -m)\n");
+	fprintf(stderr,"  -c file              save a checkpoint after each compaction\n");
+	fprintf(stderr,"  -r file              resume the search saved in a checkpoint\n");
+	fprintf(stderr,"  -W dir -U n          split the search into n work units in dir\n");
+	fprintf(stderr,"  -W dir               run the work units in dir, then report on them\n");
+	fprintf(stderr,"  -bench all|name      run the standard benchmark searches, or one of them\n");
+	fprintf(stderr,"  -j file              run each line of file as a separate search\n");
+	fprintf(stderr,"  -n count             keep searching until count patterns are found, 0 for all\n");
+	fprintf(stderr,"  -o file              also write each pattern to file, or to tcp:host:port\n");
+	fprintf(stderr,"  -f rle|bin           format of the patterns written by -o (rle)\n");
+	fprintf(stderr,"  -b count             give up deepening a queued state after expanding count states\n");
+	fprintf(stderr,"  -H y|n               look up terminal() steps in two small tables, not one big one (n)\n");
+	fprintf(stderr,"  -L count             row lists to cache per thread, 0 for none (4096)\n");
+	fprintf(stderr,"  -J file              append JSON lines of counters to file (- for stderr)\n");
+	fprintf(stderr,"  -i seconds           also write them every so many seconds\n");
+	fprintf(stderr,"  -v y|n               report hash table statistics at each compaction (n)\n");
+	fprintf(stderr,"  -z y|n               pack the rows of queued states into fewer words (n)\n");
+	fprintf(stderr,"  -T dir               cache the rule tables in dir for faster startup\n");
+	exit(1);
+}
+
+/* parse a memory size such as 512M, returning -1 if malformed or too large */
+static long readSize(char * s) {
+	char * end;
+	int shift = 0;
+	long n;
+	errno = 0;
+	n = strtol(s, &end, 10);
+	if (end == s || errno == ERANGE || n <= 0) return -1;
+	switch (*end) {
+		case 'k': case 'K': shift = 10; end++; break;
+		case 'm': case 'M': shift = 20; end++; break;
+		case 'g': case 'G': shift = 30; end++; break;
+	}
+	if (*end != '\0' || n > (LONG_MAX >> shift)) return -1;
+	return n << shift;
+}
+
+/* parse a nonnegative integer flag value, returning -1 if malformed */
+static int readCount(char * s) {
+	if (*s == '\0' || *s == '-' || nonInt(s)) return -1;
+	return atoi(s);
+}
+
+/* parse yes/no flag value, returning -1 if malformed */
+static int yesNo(char * s) {
+	switch (*s) {
+		case 'y': case 'Y': return 1;
+		case 'n': case 'N': return 0;
+	}
+	return -1;
+}
+
+/* set globals from flags; returns 0 if any flag is not understood */
+static int parseFlags(int argc, char ** argv) {
+	int i;
+	for (i = 0; i < argc; i++) {
+		char * f = argv[i];
+		char * v;
+		if (i+1 >= argc) return 0;	/* every flag takes a value */
+		v = argv[++i];
+		if (!strcmp(f, "-t")) {
+			if ((nThreads = readCount(v)) < 1) return 0;
+		} else if (!strcmp(f, "-m")) {
+			if ((memoryBudget = readSize(v)) < 0) return 0;
+		} else if (!strcmp(f, "-c")) checkpointFile = v;
+		else if (!strcmp(f, "-r")) resumeFile = v;
+		else if (!strcmp(f, "-j")) jobFile = v;
+		else if (!strcmp(f, "-bench")) benchName = v;
+		else if (!strcmp(f, "-T")) tableDir = v;
+		else if (!strcmp(f, "-s")) spillDir = v;
+		else if (!strcmp(f, "-W")) unitDir = v;
+		else if (!strcmp(f, "-o")) resultPath = v;
+		else if (!strcmp(f, "-f")) {
+			if (!strcmp(v, "bin")) resultBinary = 1;
+			else if (!strcmp(v, "rle")) resultBinary = 0;
+			else return 0;
+		}
+		else if (!strcmp(f, "-J")) {
+			if (!strcmp(v, "-")) statsOut = stderr;
+			else if ((statsOut = fopen(v, "a")) == 0) {
+				fprintf(stderr,"Unable to write %s\n", v);
+				return 0;
+			}
+		} else if (!strcmp(f, "-i")) {
+			if ((statsInterval = readCount(v)) < 0) return 0;
+			if (statsOut == 0) statsOut = stderr;
+		}
+		else if (!strcmp(f, "-U")) {
+			if ((nUnits = readCount(v)) < 1) return 0;
+		}
+		else if (!strcmp(f, "-M")) {
+			if ((spillMemory = readSize(v)) < 0) return 0;
+		}
+		else if (!strcmp(f, "-b")) {
+			if ((deepenBudget = readCount(v)) < 0) return 0;
+		} else if (!strcmp(f, "-v")) {
+			if ((verbose = yesNo(v)) < 0) return 0;
+		} else if (!strcmp(f, "-z")) {
+			if ((packQueue = yesNo(v)) < 0) return 0;
+		} else if (!strcmp(f, "-H")) {
+			if ((splitTerm = yesNo(v)) < 0) return 0;
+		} else if (!strcmp(f, "-L")) {
+			if ((rowCacheEntries = readCount(v)) < 0) return 0;
+		} else if (!strcmp(f, "-n")) {
+			if ((maxResults = readCount(v)) < 0) return 0;
+		}
+		else {
+			searchFlags++;
+			if (!strcmp(f, "-rule")) {
+				if ((rule = parseRule(v)) < 0) return 0;
+			} else if (!strcmp(f, "-p")) {
+				if ((period = readCount(v)) < 0) return 0;
+			} else if (!strcmp(f, "-sym")) {
+				switch (*v) {
+					case 'e': case 'E': symmetry = even; break;
+					case 'o': case 'O': symmetry = odd; break;
+					case 'n': case 'N': symmetry = none; break;
+					default: return 0;
+				}
+			} else if (!strcmp(f, "-complete")) {
+				if ((allow_row_sym = yesNo(v)) < 0) return 0;
+			} else if (!strcmp(f, "-w")) {
+				if ((rotorWidth = readCount(v)) < 0) return 0;
+			} else if (!strcmp(f, "-left")) {
+				if ((leftStatorWidth = readCount(v)) < 0) return 0;
+			} else if (!strcmp(f, "-right") || !strcmp(f, "-stator")) {
+				if ((rightStatorWidth = readCount(v)) < 0) return 0;
+			} else if (!strcmp(f, "-zll")) {
+				if ((zeroLotLine = yesNo(v)) < 0) return 0;
+			} else if (!strcmp(f, "-deepen")) {
+				if ((maxDeepen = readCount(v)) < 0) return 0;
+			} else if (!strcmp(f, "-row")) {
+				if (nFlagRows >= 2) return 0;
+				flagRows[nFlagRows++] = v;
+			} else if (!strcmp(f, "-sparks")) {
+				if ((sparkLevel = readCount(v)) < 0 || sparkLevel > 2) return 0;
+			} else return 0;
+		}
+	}
+	return 1;
+}
+
+/* check parameters given by flags and set up the initial states, in place of readParams() */
+static void setupSearch() {
+	int i;
+	if (period < 1 || period >= MAXPERIOD) {
+		fprintf(stderr,"Period must be an integer in the range 1..%d\n",MAXPERIOD-1);
+		exit(1);
+	}
+	if (period == 1 || symmetry != none) leftStatorWidth = 0;
+	if (period == 1) rightStatorWidth = 0;
+	if (rotorWidth <= 0 || totalWidth > MAXWIDTH) {
+		fprintf(stderr,"Total width must be in the range 1..%d\n",MAXWIDTH);
+		exit(1);
+	}
+	if (sparkLevel > 0 && nFlagRows != 2) {
+		fprintf(stderr,"Sparks need two initial rows\n");
+		exit(1);
+	}
+	makeInitialStates();
+	for (i = 0; i < nFlagRows; i++) {
+		int phase;
+		char * r = flagRows[i];
+		State s = firstFreeState;
+		firstFreeState = nextState(firstFreeState);
+		setParentState(s, firstUnprocessedState);
+		firstUnprocessedState = s;
+		for (phase = 0; phase < period; phase++) {
+			char * field = r;
+			Row row;
+			r += strcspn(r, ",");
+			if (*r == ',') *r++ = '\0';	/* missing fields at the end are empty rows */
+			if (parseRow(field, &row) != 1) {
+				fprintf(stderr,"Bad initial row %s\n", field);
+				exit(1);
+			}
+			setRowOfState(s, phase, row);
+		}
+	}
+}
+
+/* run the search set up by readParams(), setupSearch() or readCheckpoint() */
+static void search() {
+	printf("Initializing... "); fflush(stdout);
+	makeTables();
+	if (tcompatible(0,2,0)) printf("bad tcompat!\n");
+	printf("Searching...\n"); fflush(stdout);
+	startStats();
+	breadthFirst();
+	if (nResults > 0) {
+		printf("\n%ld pattern%s found, search complete\n", nResults, nResults == 1 ? "" : "s");
+		exit(0);
+	}
+	printf("No patterns found\n");
+	if (failureStatus) failureStatus = UNIT_DEAD;
+	failure();
+}
+
+static void runJobs() {
+	FILE * f = fopen(jobFile, "r");
+	char * text = 0;
+	char * line;
+	long size = 0, len = 0;
+	int job = 0;
+	if (f == 0) {
+		fprintf(stderr,"Unable to read job file %s\n", jobFile);
+		exit(1);
+	}
+	/* read it all before forking: a child's exit() would reposition a shared input stream */
+	do {
+		text = growArray(text, &size, len + 4097, 1);
+		len += fread(text + len, 1, 4096, f);
+	} while (!feof(f) && !ferror(f));
+	text[len] = '\0';
+	fclose(f);
+	for (line = text; *line != '\0'; ) {
+		char * next = line + strcspn(line, "\n");
+		char copy[4096];
+		char * args[256];
+		int n = 0, i, status;
+		int savedRule = rule;
+		pid_t pid;
+		if (*next == '\n') *next++ = '\0';
+		line[strcspn(line, "\r")] = '\0';
+		strncpy(copy, line, sizeof copy - 1);
+		copy[sizeof copy - 1] = '\0';
+		for (args[n] = strtok(copy, " \t"); args[n] != 0 && n < 255; args[++n] = strtok(0, " \t")) ;
+		if (n == 0 || args[0][0] == '#') {
+			line = next;
+			continue;
+		}
+		job++;
+		printf("\nJob %d: %s\n", job, line);
+		for (i = 0; i+1 < n; i++)
+			if (!strcmp(args[i], "-rule") && parseRule(args[i+1]) >= 0) rule = parseRule(args[i+1]);
+		makeTables();	/* before fork, so later jobs with this rule can share them */
+		rule = savedRule;
+		fflush(stdout);
+		pid = fork();
+		if (pid == 0) {
+			if (!parseFlags(n, args)) {
+				fprintf(stderr,"Job %d: bad flags\n", job);
+				exit(1);
+			}
+			if (resumeFile) readCheckpoint();
+			else setupSearch();
+			search();
+		}
+		if (pid < 0 || waitpid(pid, &status, 0) < 0) {
+			fprintf(stderr,"Unable to run job %d\n", job);
+			exit(1);
+		}
+		if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+			printf("Job %d did not finish\n", job);
+		fflush(stdout);
+		line = next;
+	}
+	free(text);
+}
+
+/*
+** -bench all runs each of these searches in a child process and reports
+** its time, peak memory, states expanded and compactions, as read from the
+** child's -J report at exit.  result is a hash (see outputHash()) of the
+** patterns or deepest line it printed, so a change in the outcome shows.
+** With -t, which pattern is found first, and where compactions fall,
+** depend on how the threads' work interleaves.  So most searches list
+** every pattern (-n 0) and fit in the queue without compacting, which
+** gives the same results on any number of threads.  p5-compact, which
+** finds one pattern and compacts, always runs on one thread.  It finds the
+** same pattern in the default, -z and -DROWBITS=64 builds, which compact
+** 3, 1 and 5 times, though a smaller -m would make them differ.  A search
+** that stops in failure(), such as on a full queue, counts as failed; one
+** that runs out of states exits with UNIT_DEAD, as a work unit would.
+*/
+
+typedef struct {
+	char * name;
+	char * flags;
+	uint32_t result;
+} Benchmark;
+
+static Benchmark benchmarks[] = {
+	{ "p3-even", "-p 3 -sym even -w 6 -n 0 -m 64M", 0x9d397d6b },
+	{ "p3-odd", "-p 3 -sym odd -w 6 -n 0 -m 64M", 0x5540f50d },
+	{ "p3-none", "-p 3 -sym none -w 5 -left 1 -n 0 -m 64M", 0x42fa32df },
+	{ "p5-even", "-p 5 -sym even -w 5 -n 0 -m 256M", 0xa44ffb3c },
+	{ "p5-odd", "-p 5 -sym odd -w 5 -n 0 -m 256M", 0xf3e38ddc },
+	{ "p5-none", "-p 5 -sym none -w 4 -left 1 -right 1 -m 256M", 0x9ed15c9c },
+	{ "p5-compact", "-p 5 -sym even -w 5 -stator 1 -m 20M -t 1", 0x9483cb37 },
+	{ "p1-still", "-p 1 -sym even -w 7 -n 0 -m 64M", 0x9663ad66 },
+	{ "p3-spark", "-p 3 -sym even -w 4 -stator 1 -row .o..,.o..,.o.. -row .o..,.o..,.o.. -sparks 2 -n 0 -m 64M", 0x097a4413 },
+};
+#define NBENCHMARKS (sizeof benchmarks / sizeof benchmarks[0])
+
+/* sum of FNV-1a hashes of the blocks of pattern lines in f, which does not
+   depend on the order in which -n prints them; the current lines printed
+   at each compaction are left out, since -z and -DROWBITS move them */
+static uint32_t outputHash(FILE * f) {
+	char line[4096];
+	uint32_t h = 0, block = 2166136261U;
+	int inBlock = 0, skip = 0;
+	rewind(f);
+	while (fgets(line, sizeof line, f) != 0) {
+		size_t n = strspn(line, ".o");
+		char * c;
+		if (n == 0 || (line[n] != '\n' && line[n] != '\0')) {
+			if (inBlock) h += block;
+			inBlock = 0;
+			skip = !strcmp(line, "Current line found:\n");
+			continue;
+		}
+		if (skip) continue;
+		if (!inBlock) block = 2166136261U;
+		inBlock = 1;
+		for (c = line; *c; c++) block = (block ^ (unsigned char) *c) * 16777619U;
+	}
+	if (inBlock) h += block;
+	return h;
+}
+
+/* value of "field":number in a line of JSON, or -1 */
+static long jsonField(char * json, char * field) {
+	char key[64];
+	char * p;
+	snprintf(key, sizeof key, "\"%s\":", field);
+	p = strstr(json, key);
+	return p ? atol(p + strlen(key)) : -1;
+}
+
+static void runBenchmarks() {
+	size_t i;
+	int ran = 0, changed = 0;
+	for (i = 0; i < NBENCHMARKS && strcmp(benchName, "all") && strcmp(benchName, benchmarks[i].name); i++) ;
+	if (i == NBENCHMARKS) {
+		fprintf(stderr,"No benchmark named %s\n", benchName);
+		exit(1);
+	}
+	printf("%-10s %8s %8s %9s %10s %5s  %s\n", "benchmark", "seconds", "cpu", "peak RSS",
+		   "states", "comp", "result");
+	for (i = 0; i < NBENCHMARKS; i++) {
+		Benchmark * b = &benchmarks[i];
+		char copy[1024], json[4096], states[32];
+		char * args[64];
+		int n = 0, fds[2], status;
+		FILE * out, * report;
+		struct timeval start, end;
+		struct rusage usage;
+		uint32_t h;
+		pid_t pid;
+		int failed;
+		if (strcmp(benchName, "all") && strcmp(benchName, b->name)) continue;
+		strcpy(copy, b->flags);
+		for (args[n] = strtok(copy, " "); args[n] != 0 && n < 63; args[++n] = strtok(0, " ")) ;
+		out = tmpfile();
+		if (out == 0 || pipe(fds) != 0) {
+			fprintf(stderr,"Unable to run benchmark %s\n", b->name);
+			exit(1);
+		}
+		fflush(stdout);
+		gettimeofday(&start, 0);
+		pid = fork();
+		if (pid == 0) {
+			close(fds[0]);
+			dup2(fileno(out), 1);
+			statsOut = fdopen(fds[1], "w");
+			failureStatus = UNIT_UNFINISHED;	/* so an aborted search shows */
+			if (!parseFlags(n, args)) exit(1);
+			setupSearch();
+			search();
+		}
+		close(fds[1]);
+		if (pid < 0 || wait4(pid, &status, 0, &usage) < 0) {
+			fprintf(stderr,"Unable to run benchmark %s\n", b->name);
+			exit(1);
+		}
+		gettimeofday(&end, 0);
+		report = fdopen(fds[0], "r");
+		json[0] = '\0';
+		while (report != 0 && fgets(json, sizeof json, report) != 0 && !strstr(json, "\"exit\"")) ;
+		if (report != 0) fclose(report);
+		h = outputHash(out);
+		fclose(out);
+		failed = !WIFEXITED(status) || (WEXITSTATUS(status) != 0 && WEXITSTATUS(status) != UNIT_DEAD);
+		if (jsonField(json, "states") < 0) strcpy(states, "-");	/* built with -DNOSTATS */
+		else snprintf(states, sizeof states, "%ld", jsonField(json, "states"));
+		printf("%-10s %8.2f %8.2f %8ldk %10s %5ld  %08x%s\n", b->name,
+			   (end.tv_sec - start.tv_sec) + (end.tv_usec - start.tv_usec) / 1e6,
+			   usage.ru_utime.tv_sec + usage.ru_stime.tv_sec +
+			   (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6,
+			   usage.ru_maxrss, states, jsonField(json, "compactions"), h,
+			   failed ? " failed" : h != b->result ? " changed" : "");
+		fflush(stdout);
+		if (failed || h != b->result) changed++;
+		ran++;
+	}
+	if (changed) printf("%d of %d results differ from the expected ones\n", changed, ran);
+}
+
+/* a work unit is a file in unitDir named unit- and five digits */
+static int isUnitName(char * name) {
+	return strlen(name) == 10 && !strncmp(name, "unit-", 5) && strspn(name+5, "0123456789") == 5;
+}
+
+static int hasSuffix(char * name, char * suffix) {
+	size_t n = strlen(name), m = strlen(suffix);
+	return n > m && !strcmp(name + n - m, suffix);
+}
+
+/* claim a waiting work unit by renaming it to claim; returns 0 if none is left */
+static int claimUnit(char * unit, size_t unitSize, char * claim, size_t claimSize) {
+	DIR * d = opendir(unitDir);
+	struct dirent * e;
+	char host[256];
+	int found = 0;
+	if (d == 0) {
+		fprintf(stderr,"Unable to read work unit directory %s\n", unitDir);
+		exit(1);
+	}
+	if (gethostname(host, sizeof host) != 0) strcpy(host, "localhost");
+	host[sizeof host - 1] = '\0';
+	while (!found && (e = readdir(d)) != 0) {
+		if (!isUnitName(e->d_name)) continue;
+		snprintf(unit, unitSize, "%s/%s", unitDir, e->d_name);
+		snprintf(claim, claimSize, "%s.%s.%ld", unit, host, (long) getpid());
+		found = rename(unit, claim) == 0;	/* fails if another worker got there first */
+	}
+	closedir(d);
+	return found;
+}
+
+/* run the work units in unitDir until none are left, then report on them all */
+static void runUnits() {
+	char unit[1100], claim[1400], out[1200], done[1200];
+	long nFound = 0, nDead = 0, nOther = 0;
+	DIR * d;
+	struct dirent * e;
+	while (claimUnit(unit, sizeof unit, claim, sizeof claim)) {
+		CheckpointHeader h;
+		int status;
+		pid_t pid;
+		close(openCheckpoint(claim, &h));
+		rule = h.rule;
+		makeTables();	/* before fork, so later units can share them */
+		snprintf(out, sizeof out, "%s.out", unit);
+		printf("%s: ", unit);
+		fflush(stdout);
+		pid = fork();
+		if (pid == 0) {
+			if (freopen(out, "w", stdout) == 0) exit(1);
+			resumeFile = claim;
+			failureStatus = UNIT_UNFINISHED;
+			readCheckpoint();
+			search();
+		}
+		if (pid < 0 || waitpid(pid, &status, 0) < 0) {
+			fprintf(stderr,"Unable to run work unit %s\n", unit);
+			exit(1);
+		}
+		status = WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+		if (status == 0 || status == UNIT_DEAD) {
+			snprintf(done, sizeof done, "%s.%s", unit, status == 0 ? "found" : "dead");
+			rename(out, done);
+			remove(claim);
+			printf("%s\n", status == 0 ? "found" : "dead");
+		} else printf("did not finish, left as %s\n", claim);
+		fflush(stdout);
+	}
+
+	/* merge the results of every worker so far */
+	d = opendir(unitDir);
+	while (d != 0 && (e = readdir(d)) != 0) {
+		if (hasSuffix(e->d_name, ".found")) {
+			FILE * f;
+			int c;
+			snprintf(done, sizeof done, "%s/%s", unitDir, e->d_name);
+			if ((f = fopen(done, "r")) == 0) continue;
+			printf("\nFrom %s:\n", e->d_name);
+			while ((c = getc(f)) != EOF) putchar(c);
+			fclose(f);
+			nFound++;
+		} else if (hasSuffix(e->d_name, ".dead")) nDead++;
+		else if (!strncmp(e->d_name, "unit-", 5) && !hasSuffix(e->d_name, ".out")) nOther++;
+	}
+	if (d != 0) closedir(d);
+	printf("\nWork units in %s: %ld found, %ld dead, %ld running or unfinished\n",
+		   unitDir, nFound, nDead, nOther);
+}
+
 /* ============ */
 /*  Main entry  */
 /* ============ */
 
-int main(void)
+int main(int argc, char ** argv)
 {
+	patternOut = stdout;
+	if (!parseFlags(argc-1, argv+1)) usage();
 	printf("ofind 0.9, D. Eppstein, 14 August 2000\n");
+	initScratch();
 	initHash();
-	readParams();
-	printf("Initializing... "); fflush(stdout);
 	makeDownShifts();
-	makeExtTab();
-	initTermTabs();
-	if (tcompatible(0,2,0)) printf("bad tcompat!\n");
-	printf("Searching...\n"); fflush(stdout);
-	fflush(stdout);
-	breadthFirst();
-	printf("No patterns found\n");
-	failure();
+	if (jobFile) {
+		runJobs();
+		return 0;
+	}
+	if (unitDir && nUnits == 0) {
+		runUnits();
+		return 0;
+	}
+	if (benchName) {
+		makeTables();
+		runBenchmarks();
+		return 0;
+	}
+	if (resumeFile) readCheckpoint();
+	else if (searchFlags) setupSearch();
+	else readParams();
+	search();
 	return 0;
 }
-